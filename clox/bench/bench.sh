@@ -0,0 +1,70 @@
+#!/bin/sh
+# Build clox with the given compiler flags variants and run every
+# `bench/*.lox` script with each of them.
+#
+# usage: bench/bench.sh [-r runs] [name=CFLAGS ...]
+#
+# Without variants, compares the `switch` dispatch against the
+# computed goto one. Reported times are the best of `runs` wall clock runs.
+# Flags starting with `--` are clox options instead, passed when running
+# the scripts, eg: `bench/bench.sh stack= register=--register`.
+set -e
+
+cd "$(dirname "$0")/.."
+
+RUNS=3
+if [ "$1" = "-r" ]; then
+  RUNS=$2
+  shift 2
+fi
+
+if [ $# -eq 0 ]; then
+  set -- "switch=-DNO_COMPUTED_GOTO" "goto="
+fi
+
+CC=${CC:-gcc}
+BUILD_DIR=${BUILD_DIR:-/tmp/clox-bench}
+mkdir -p "$BUILD_DIR"
+
+NAMES=""
+for variant in "$@"; do
+  name=${variant%%=*}
+  flags=""
+  options=""
+  for flag in ${variant#*=}; do
+    case "$flag" in
+    --*) options="$options $flag" ;;
+    *) flags="$flags $flag" ;;
+    esac
+  done
+  # shellcheck disable=SC2086
+  $CC -O2 -I. $flags -o "$BUILD_DIR/clox-$name" *.c -lpthread
+  echo "$options" >"$BUILD_DIR/clox-$name.options"
+  NAMES="$NAMES $name"
+done
+
+printf "%-16s" "benchmark"
+for name in $NAMES; do
+  printf "%12s" "$name"
+done
+printf "\n"
+
+for script in bench/*.lox; do
+  printf "%-16s" "$(basename "$script" .lox)"
+  for name in $NAMES; do
+    best=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+      start=$(date +%s.%N)
+      # shellcheck disable=SC2046
+      "$BUILD_DIR/clox-$name" $(cat "$BUILD_DIR/clox-$name.options") \
+        "$script" >/dev/null
+      end=$(date +%s.%N)
+      best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+        'BEGIN { t = e - s; if (b == "" || t < b) b = t; print b }')
+      i=$((i + 1))
+    done
+    printf "%11.3fs" "$best"
+  done
+  printf "\n"
+done
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Scaling of the parallel marking: run `bench/gc/marking.lox` (a heap of
+# 4 million objects) with 1 to 16 marking threads, and report the time
+# spent marking in the collection pauses.
+#
+# usage: bench/gc-threads.sh [-r runs] [threads ...]
+#
+# Reported times are the best of `runs` runs.
+set -e
+
+cd "$(dirname "$0")/.."
+
+RUNS=3
+if [ "$1" = "-r" ]; then
+  RUNS=$2
+  shift 2
+fi
+
+if [ $# -eq 0 ]; then
+  set -- 1 2 4 8 16
+fi
+
+CC=${CC:-gcc}
+BUILD_DIR=${BUILD_DIR:-/tmp/clox-bench}
+mkdir -p "$BUILD_DIR"
+$CC -O2 -I. -o "$BUILD_DIR/clox-gc" *.c -lpthread
+
+printf "%-8s%12s%12s\n" "threads" "marking" "total"
+for threads in "$@"; do
+  best=""
+  bestTotal=""
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    stats=$("$BUILD_DIR/clox-gc" --gc-threads="$threads" --gc-stats \
+      bench/gc/marking.lox 2>&1 >/dev/null)
+    marking=$(echo "$stats" | awk '/tracing/ { print $2 / 1000 }')
+    total=$(echo "$stats" | awk '/total/ { print $2 / 1000 }')
+    best=$(awk -v t="$marking" -v b="$best" \
+      'BEGIN { if (b == "" || t < b) b = t; print b }')
+    bestTotal=$(awk -v t="$total" -v b="$bestTotal" \
+      'BEGIN { if (b == "" || t < b) b = t; print b }')
+    i=$((i + 1))
+  done
+  printf "%-8s%11.3fs%11.3fs\n" "$threads" "$best" "$bestTotal"
+done
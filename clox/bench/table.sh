@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compare the `Table` of the working tree with the one of a revision:
+# build `bench/table/tables.c` against both, and run it.
+#
+# usage: bench/table.sh [revision]
+#
+# The revision defaults to HEAD.
+set -e
+
+cd "$(dirname "$0")/.."
+
+REVISION=${1:-HEAD}
+CC=${CC:-gcc}
+BUILD_DIR=${BUILD_DIR:-/tmp/clox-bench}
+BASE_DIR="$BUILD_DIR/table-base"
+rm -rf "$BASE_DIR"
+mkdir -p "$BASE_DIR"
+git archive "$REVISION" . | tar -x -C "$BASE_DIR"
+
+# every source but main.c, which has its own `main()`
+build() {
+  sources=$(ls "$1"/*.c | grep -v '/main\.c$')
+  # shellcheck disable=SC2086
+  $CC -O2 -I"$1" -o "$2" bench/table/tables.c $sources -lpthread
+}
+build "$BASE_DIR" "$BUILD_DIR/tables-base"
+build . "$BUILD_DIR/tables"
+
+echo "$REVISION:"
+"$BUILD_DIR/tables-base"
+echo "working tree:"
+"$BUILD_DIR/tables"
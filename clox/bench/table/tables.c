@@ -0,0 +1,101 @@
+// Microbenchmark of the `Table` API, on string keys: lookups that hit,
+// lookups that miss, and keys inserted then deleted. Each workload runs on
+// a small table (like a class methods) and on big ones (like the strings).
+// Built by `bench/table.sh`, against the tables of two revisions.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// timed operations, per workload and table size
+#define OPERATIONS (1 << 24)
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// `count` different strings, starting with `prefix`
+static ObjString **makeKeys(const char *prefix, int count) {
+  ObjString **keys = malloc(sizeof(ObjString *) * count);
+  char chars[32];
+  for (int i = 0; i < count; i++) {
+    int length = snprintf(chars, sizeof(chars), "%s%d", prefix, i);
+    keys[i] = copyString(chars, length);
+  }
+  return keys;
+}
+
+static void fill(Table *table, ObjString **keys, int count) {
+  for (int i = 0; i < count; i++) {
+    tableSet(table, keys[i], NUMBER_VAL(i));
+  }
+}
+
+// lookups of keys from `keys`, in turn: returns the ones found
+static int lookup(Table *table, ObjString **keys, int count) {
+  int found = 0;
+  Value value;
+  for (int i = 0, key = 0; i < OPERATIONS; i++) {
+    found += tableGet(table, keys[key], &value);
+    if (++key == count) {
+      key = 0;
+    }
+  }
+  return found;
+}
+
+// insert all the keys, then delete them all, until OPERATIONS
+static int churn(Table *table, ObjString **keys, int count) {
+  int deleted = 0;
+  for (int i = 0; i < OPERATIONS; i += 2 * count) {
+    fill(table, keys, count);
+    for (int key = 0; key < count; key++) {
+      deleted += tableDelete(table, keys[key]);
+    }
+  }
+  return deleted;
+}
+
+static void report(const char *workload, int size, double start,
+                   int result) {
+  printf("%-8s%10d%10.2f ns/op  (%d)\n", workload, size,
+         (now() - start) * 1e9 / OPERATIONS, result);
+}
+
+int main(void) {
+  static const int sizes[] = {6, 1000, 100000};
+  initVM();
+  // the keys are only referenced from here: no collection
+  vm.nextGC = (size_t)-1;
+
+  printf("%-8s%10s%10s\n", "workload", "entries", "time");
+  for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    int size = sizes[i];
+    ObjString **keys = makeKeys("key", size);
+    ObjString **others = makeKeys("other", size);
+    Table table;
+    initTable(&table);
+    fill(&table, keys, size);
+
+    double start = now();
+    report("hit", size, start, lookup(&table, keys, size));
+    start = now();
+    report("miss", size, start, lookup(&table, others, size));
+    freeTable(&table);
+
+    initTable(&table);
+    start = now();
+    report("delete", size, start, churn(&table, keys, size));
+    freeTable(&table);
+    free(keys);
+    free(others);
+  }
+  freeVM();
+  return 0;
+}
@@ -12,6 +12,14 @@ void initChunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->registers.count = 0;
+  chunk->registers.capacity = 0;
+  chunk->registers.code = NULL;
+  chunk->registers.lines = NULL;
+  chunk->registers.registerCount = 0;
 }
 
 // append byte to chunk, re-allocate if needed.
@@ -30,10 +38,51 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   chunk->count++;
 }
 
+// append byte to register code, re-allocate if needed.
+void writeRegisterCode(RegisterCode *code, uint8_t byte, int line) {
+  if (code->capacity < code->count + 1) {
+    int oldCapacity = code->capacity;
+    code->capacity = GROW_CAPACITY(oldCapacity);
+    code->code = GROW_ARRAY(uint8_t, code->code, oldCapacity, code->capacity);
+    code->lines = GROW_ARRAY(int, code->lines, oldCapacity, code->capacity);
+  }
+  code->code[code->count] = byte;
+  code->lines[code->count] = line;
+  code->count++;
+}
+
+// instructions with a 16 bits jump offset operand
+bool isJumpInstruction(uint8_t instruction) {
+  switch (instruction) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// offset the jump instruction at `offset` lands on
+int jumpTarget(Chunk *chunk, int offset) {
+  int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_LOOP) {
+    return offset + 3 - jump;
+  }
+  return offset + 3 + jump;
+}
+
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+  FREE_ARRAY(uint8_t, chunk->registers.code, chunk->registers.capacity);
+  FREE_ARRAY(int, chunk->registers.lines, chunk->registers.capacity);
   initChunk(chunk);
 }
 
@@ -45,3 +94,176 @@ int addConstant(Chunk *chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+// append an empty inline cache, and return its index.
+int addInlineCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    cache->ways[i].shape = NULL;
+    cache->ways[i].version = 0;
+    cache->ways[i].field = -1;
+    cache->ways[i].method = NULL;
+    cache->ways[i].transition = NULL;
+  }
+  return chunk->cacheCount++;
+}
+
+// returns the size (opcode + operands) of the instruction at `offset`.
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_ADD_CONSTANT:
+  case OP_SUBSTRACT_CONSTANT:
+  case OP_SET_LOCAL_POP:
+    return 2;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_POP:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return 3;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return 4;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return 5;
+  case OP_CLOSURE: {
+    // followed by a (isLocal, index) pair per upvalue
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+// change of the stack size after the instruction at `offset` ran
+static int stackEffect(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code;
+  switch (code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBSTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_SUBSTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+  case OP_SET_LOCAL_POP:
+  case OP_SET_GLOBAL_POP:
+    return -1;
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_GREATER:
+    return -2;
+  // the arguments are popped, the callee replaced by the result
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[offset + 1];
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return -code[offset + 2];
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return -code[offset + 2] - 1; // and the superclass
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Returns the largest size the stack reaches while running `chunk`,
+ * starting with `depth` values (the callee and its arguments).
+ * `call()` reserves that much room for the frame, so that pushing
+ * never checks for overflow.
+ */
+int maxStackDepth(Chunk *chunk, int depth) {
+  int count = chunk->count;
+  // depth when landing on each offset, -1 if no jump lands there
+  int *targetDepths = ALLOCATE(int, count + 1);
+  for (int i = 0; i <= count; i++) {
+    targetDepths[i] = -1;
+  }
+
+  int max = depth;
+  bool reachable = true;
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    // after a jump or a return, only reached by jumping there. Code no
+    // forward jump lands on is either dead, or only reached by a loop
+    // (the increment clause of a `for`), at the depth it follows.
+    if (!reachable && targetDepths[offset] != -1) {
+      depth = targetDepths[offset];
+      reachable = true;
+    }
+    depth += stackEffect(chunk, offset);
+    if (depth > max) {
+      max = depth;
+    }
+    if (reachable && isJumpInstruction(instruction)) {
+      int target = jumpTarget(chunk, offset);
+      if (targetDepths[target] == -1) {
+        targetDepths[target] = depth;
+      }
+    }
+    if (instruction == OP_JUMP || instruction == OP_LOOP ||
+        instruction == OP_RETURN) {
+      reachable = false;
+    }
+  }
+
+  FREE_ARRAY(int, targetDepths, count + 1);
+  return max;
+}
@@ -12,13 +12,14 @@ typedef enum {
   OP_POP,       // drop last inserted stack entry
   OP_GET_LOCAL, // load from stack
   OP_SET_LOCAL,
-  OP_GET_GLOBAL, // load from global hastable
+  OP_GET_GLOBAL, // load from global slot (16 bits index operand)
   OP_DEFINE_GLOBAL,
   OP_SET_GLOBAL,
   OP_GET_UPVALUE, // load from closure `upvalue` (either stored directly in the
                   // array or referenced by it)
   OP_SET_UPVALUE,
   OP_GET_PROPERTY, // load from ?
+                   // (operands: name constant, 16 bits inline cache index)
   OP_SET_PROPERTY,
   OP_GET_SUPER, // resolve `super.method`
   OP_EQUAL,
@@ -36,7 +37,15 @@ typedef enum {
   OP_LOOP, // backward jump
   OP_CALL,
   OP_INVOKE,        // call a method (bound to an object)
+                    // (operands: name, arg count, 16 bits inline cache index)
   OP_SUPER_INVOKE,  // call a super method (bound to an object)
+  // Tail calls: `return f(...);`, the callee replaces the frame of the
+  // caller. Same operands as the call they stand for, always followed by
+  // an `OP_RETURN`, which only runs if the backend treats them as plain
+  // calls.
+  OP_TAIL_CALL,
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
   OP_CLOSURE,       // push closure onto stack
   OP_CLOSE_UPVALUE, // move local variable onto heap, so it can outlive the its
                     // stackframe, and be referred by closures.
@@ -44,8 +53,124 @@ typedef enum {
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD, // bind a method to a class object
+  // Quickened instructions: never emitted by the compiler, the VM rewrites
+  // a generic instruction to one of them (in place) once it saw the types
+  // of its operands, and rewrites it back when the guess is wrong.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBSTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  // Superinstructions: emitted by the peephole pass (see peephole.c) in
+  // place of the sequence of instructions they fuse.
+  OP_POP_JUMP_IF_FALSE,  // OP_JUMP_IF_FALSE + OP_POP, on both branches
+  OP_POP_JUMP_IF_TRUE,   // OP_NOT + OP_POP_JUMP_IF_FALSE
+  OP_JUMP_IF_NOT_LESS,   // OP_LESS + OP_POP_JUMP_IF_FALSE
+  OP_JUMP_IF_NOT_GREATER, // OP_GREATER + OP_POP_JUMP_IF_FALSE
+  OP_ADD_CONSTANT,       // OP_CONSTANT (a number) + OP_ADD
+  OP_SUBSTRACT_CONSTANT, // OP_CONSTANT (a number) + OP_SUBSTRACT
+  OP_SET_LOCAL_POP,      // OP_SET_LOCAL + OP_POP
+  OP_SET_GLOBAL_POP,     // OP_SET_GLOBAL + OP_POP
+  OP_COUNT, // number of opcodes, not an instruction
 } OpCode;
 
+// Instructions of the register-based backend (see `runRegister()`).
+// Lua-like three-address code: operands are registers, eg: the slots of
+// the call frame (locals first, then temporaries), written `R`, or indices
+// in the chunk constants, written `K`. The first operand is the
+// destination. Names, inline caches and global slots are encoded as with
+// the stack instructions.
+typedef enum {
+  REG_MOVE,      // R[A] = R[B]
+  REG_LOADK,     // R[A] = K[B]
+  REG_LOADNIL,   // R[A] = nil
+  REG_LOADTRUE,  // R[A] = true
+  REG_LOADFALSE, // R[A] = false
+  REG_GET_GLOBAL,    // R[A] = globals[slot16]
+  REG_DEFINE_GLOBAL, // globals[slot16] = R[A]
+  REG_SET_GLOBAL,    // globals[slot16] = R[A], must be defined
+  REG_GET_UPVALUE,   // R[A] = upvalues[B]
+  REG_SET_UPVALUE,   // upvalues[B] = R[A]
+  REG_GET_PROPERTY,  // R[A] = R[B].name (name, 16 bits inline cache)
+  REG_SET_PROPERTY,  // R[A].name = R[C] (name, 16 bits inline cache, C)
+  REG_GET_SUPER,     // R[A] = method of R[C] (superclass) bound to R[B]
+                     // (B, C, name)
+  REG_EQUAL,         // R[A] = R[B] == R[C]
+  REG_GREATER,
+  REG_LESS,
+  REG_ADD,
+  REG_SUBSTRACT,
+  REG_MULTIPLY,
+  REG_DIVIDE,
+  REG_EQUAL_K,       // R[A] = R[B] == K[C], same for the other `_K`
+  REG_GREATER_K,
+  REG_LESS_K,
+  REG_ADD_K,
+  REG_SUBSTRACT_K,
+  REG_MULTIPLY_K,
+  REG_DIVIDE_K,
+  REG_NOT,           // R[A] = !R[B]
+  REG_NEGATE,        // R[A] = -R[B]
+  REG_PRINT,         // print R[A]
+  REG_JUMP,          // ip += offset16
+  REG_LOOP,          // ip -= offset16
+  REG_JUMP_IF_FALSE, // if R[A] is falsey, ip += offset16
+  REG_JUMP_IF_TRUE,  // if R[A] is truthy, ip += offset16
+  REG_JUMP_IF_NOT_LESS,      // if !(R[A] < R[B]), ip += offset16
+  REG_JUMP_IF_NOT_LESS_K,    // if !(R[A] < K[B]), ip += offset16
+  REG_JUMP_IF_NOT_GREATER,   // if !(R[A] > R[B]), ip += offset16
+  REG_JUMP_IF_NOT_GREATER_K, // if !(R[A] > K[B]), ip += offset16
+  REG_CALL,   // R[A] = R[A](R[A+1], ..., R[A+B])
+  REG_INVOKE, // R[A] = R[A].name(R[A+1], ...) (name, arg count, 16 bits
+              // inline cache)
+  REG_SUPER_INVOKE, // R[A] = super (R[C]) method `name` called on R[A]
+                    // (name, arg count, C)
+  REG_TAIL_CALL,    // return R[A](R[A+1], ..., R[A+B]), in the same frame
+  REG_TAIL_INVOKE,  // same for `REG_INVOKE`
+  REG_TAIL_SUPER_INVOKE, // same for `REG_SUPER_INVOKE`
+  REG_CLOSURE,      // R[A] = closure of K[B], followed by its upvalues
+  REG_CLOSE,        // close the upvalues pointing to R[A] and above
+  REG_RETURN,       // return R[A]
+  REG_CLASS,        // R[A] = class `name`
+  REG_INHERIT,      // copy methods of R[A] (superclass) into R[B]
+  REG_METHOD,       // bind method R[B] to class R[A] (name)
+  REG_COUNT, // number of register opcodes, not an instruction
+} RegisterOpCode;
+
+// register-based translation of a chunk
+typedef struct {
+  int count; // length of `code` and `lines`
+  int capacity;
+  uint8_t *code;
+  int *lines;
+  int registerCount; // size of the call frame (in slots)
+} RegisterCode;
+
+// number of receiver shapes remembered by each inline cache
+#define INLINE_CACHE_WAYS 4
+
+// remembers where a property lookup led, for one receiver shape.
+typedef struct {
+  struct ObjShape *shape; // receiver shape, NULL if this way is unused
+  int version;            // class `version` when a method was cached
+  int field;              // index of the field in the instance `fields`,
+                          // -1 if the property is a method
+  struct ObjClosure *method;     // the class method, if `field` is -1
+  struct ObjShape *transition;   // OP_SET_PROPERTY adding a field: shape
+                                 // of the instance once it's added
+} InlineCacheWay;
+
+// Per call site cache of the property lookups done by OP_GET_PROPERTY,
+// OP_SET_PROPERTY and OP_INVOKE, (their last operand is the cache index).
+// `ways[0]` is the monomorphic fast path, the other ones are only
+// used by polymorphic sites. When all of them are taken, the site is
+// considered megamorphic and stops caching.
+typedef struct {
+  InlineCacheWay ways[INLINE_CACHE_WAYS];
+} InlineCache;
+
 // holds TEXT + DATA + DEBUG info
 typedef struct {
   int count; // length of `code` and `lines`
@@ -54,11 +179,21 @@ typedef struct {
                  // constant)
   int *lines;    // line nb of each `code` instruction
   ValueArray constants;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches; // one per property access site
+  RegisterCode registers; // only built for the register backend
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+bool isJumpInstruction(uint8_t instruction);
+int jumpTarget(Chunk *chunk, int offset);
+int maxStackDepth(Chunk *chunk, int depth);
+void writeRegisterCode(RegisterCode *code, uint8_t byte, int line);
 
 #endif
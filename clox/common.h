@@ -17,10 +17,59 @@
 // print GC degug info, at each pass
 // #define DEBUG_LOG_GC
 
+// count inline caches hits and misses, print their hit rates
+// when the VM is freed.
+// #define DEBUG_IC_STATS
+
+// count how often each opcode is directly followed by each other one,
+// print the most frequent pairs when the VM is freed.
+// (used to pick the superinstructions)
+// #define DEBUG_OPCODE_PAIRS
+
 // if set, use Nan Boxing to reduce the size of
 // the Value type down to 64 bits.
 #define NAN_BOXING
 
+// if set, dispatch bytecode through a table of label addresses
+// ("computed goto") instead of a `switch`. Only used by compilers
+// supporting the GCC "labels as values" extension.
+// Build with `-DNO_COMPUTED_GOTO` to force the `switch` dispatch.
+#ifndef NO_COMPUTED_GOTO
+#define COMPUTED_GOTO
+#endif
+
+// if set, fuse common instruction sequences into superinstructions
+// once a chunk is compiled (see peephole.c).
+// Build with `-DNO_PEEPHOLE` to run the bytecode as emitted.
+#ifndef NO_PEEPHOLE
+#define PEEPHOLE
+#endif
+
+// if set, compile hot functions to x86-64 machine code (see jit.c).
+// Needs NaN boxing (the machine code works on raw 64 bits values) and
+// `mmap()`. Build with `-DNO_JIT`, or run with `--no-jit`, to only
+// interpret the bytecode.
+#if !defined(NO_JIT) && defined(NAN_BOXING) && defined(__x86_64__) &&        \
+    (defined(__linux__) || defined(__APPLE__))
+#define JIT
+#endif
+
+// if set, `--gc-concurrent` marks the old generation in a background
+// thread (see memory.c). Needs NaN boxing (the marker reads a value with a
+// single load), POSIX threads, and x86-64: the program publishes objects
+// to the marker with plain stores, which only its memory model keeps in
+// order. Build with `-DNO_CONCURRENT_GC` to leave it out.
+#if !defined(NO_CONCURRENT_GC) && defined(NAN_BOXING) && defined(__x86_64__)
+#define CONCURRENT_GC
+#endif
+
+// if set, `--gc-threads=<n>` spreads the marking of the stop-the-world
+// pauses over `n` threads (see memory.c). Needs POSIX threads. Build with
+// `-DNO_PARALLEL_GC` to leave it out.
+#if !defined(NO_PARALLEL_GC) && (defined(__linux__) || defined(__APPLE__))
+#define PARALLEL_GC
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -6,7 +6,9 @@
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -78,6 +80,7 @@ typedef struct Compiler { // this is the weird C syntax for self referencing
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall; // offset of the last call emitted (see returnStatement())
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -185,6 +188,27 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+/**
+ * Reserve an inline cache for the property access site being emitted,
+ * and write its index (16 bits) to the current chunk.
+ */
+static void emitInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one chunk.");
+  }
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+/**
+ * Emit a global variable instruction, followed by the variable slot index
+ * (16 bits) in `vm.globalValues`.
+ */
+static void emitGlobal(uint8_t op, uint16_t slot) {
+  emitByte(op);
+  emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
   int offset = currentChunk()->count - loopStart + 2;
@@ -210,6 +234,7 @@ static void emitReturn() {
 
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
+  writeBarrier((Obj *)current->function, value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunks.");
     return 0;
@@ -249,12 +274,15 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Obj *)current->function,
+                 OBJ_VAL(current->function->name));
   }
 
   Local *local = &current->locals[current->localCount++];
@@ -269,6 +297,555 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   }
 }
 
+/*
+ * Register backend.
+ *
+ * The stack code of a finished chunk is translated into register code
+ * (see `RegisterOpCode`): the stack depth at each instruction is known
+ * statically, so each stack slot becomes a register of the call frame.
+ * Locals already live in their slot, so they are registers for free.
+ *
+ * The translator keeps a "virtual stack" of operands: loading a local or a
+ * constant emits nothing, it pushes the register (or constant) holding the
+ * value, which is directly used as the operand of the instruction
+ * consuming it. eg: `a = b + c` (with a, b and c locals) becomes a single
+ * `REG_ADD a b c` instead of `GET_LOCAL b; GET_LOCAL c; ADD; SET_LOCAL a; POP`.
+ *
+ * A deferred operand has to be "materialized" (copied to its own slot)
+ * before the register it reads is overwritten, before calls (the callee
+ * might change a captured local, and its frame overlaps our temporaries),
+ * and at jumps and jump targets (so every path agrees on where values are).
+ */
+
+// where a value of the translator virtual stack lives
+typedef enum {
+  OPERAND_REGISTER,
+  OPERAND_CONSTANT,
+} OperandType;
+
+typedef struct {
+  OperandType type;
+  int index; // register, or constant index
+} Operand;
+
+// a jump, waiting for its offset
+typedef struct {
+  int operand; // offset of the 16 bits offset operand, in the register code
+  int end;     // offset of the next instruction, in the register code
+  int target;  // offset of the target, in the stack code
+} RegisterJump;
+
+typedef struct {
+  Chunk *chunk;
+  RegisterCode *code;
+  Operand stack[UINT8_COUNT]; // indexed by slot
+  int depth;
+  int line;
+  int lastDest; // offset of the destination operand of the last emitted
+                // instruction, if it pushed its result, -1 otherwise
+  bool failed;  // the function doesn't fit in 256 registers
+} RegisterTranslator;
+
+static void emitRegister(RegisterTranslator *t, uint8_t byte) {
+  writeRegisterCode(t->code, byte, t->line);
+}
+
+static void emitRegisterOp(RegisterTranslator *t, uint8_t op) {
+  t->lastDest = -1;
+  emitRegister(t, op);
+}
+
+static void useRegister(RegisterTranslator *t, int reg) {
+  if (reg >= UINT8_COUNT) {
+    t->failed = true;
+  } else if (reg >= t->code->registerCount) {
+    t->code->registerCount = reg + 1;
+  }
+}
+
+static void pushOperand(RegisterTranslator *t, OperandType type, int index) {
+  if (t->depth == UINT8_COUNT) {
+    t->failed = true;
+    return;
+  }
+  useRegister(t, t->depth);
+  t->stack[t->depth].type = type;
+  t->stack[t->depth].index = index;
+  t->depth++;
+}
+
+static bool isMaterialized(RegisterTranslator *t, int slot) {
+  return t->stack[slot].type == OPERAND_REGISTER &&
+         t->stack[slot].index == slot;
+}
+
+static void invalidateRegister(RegisterTranslator *t, int reg);
+
+// copy the value of `slot` into its own register
+static void materialize(RegisterTranslator *t, int slot) {
+  if (isMaterialized(t, slot))
+    return;
+  invalidateRegister(t, slot);
+  Operand operand = t->stack[slot];
+  emitRegisterOp(t, operand.type == OPERAND_REGISTER ? REG_MOVE : REG_LOADK);
+  emitRegister(t, slot);
+  emitRegister(t, operand.index);
+  t->stack[slot].type = OPERAND_REGISTER;
+  t->stack[slot].index = slot;
+}
+
+// `reg` is about to be overwritten: materialize the operands reading it.
+static void invalidateRegister(RegisterTranslator *t, int reg) {
+  for (int slot = 0; slot < t->depth; slot++) {
+    if (slot != reg && t->stack[slot].type == OPERAND_REGISTER &&
+        t->stack[slot].index == reg) {
+      materialize(t, slot);
+    }
+  }
+}
+
+static void materializeAll(RegisterTranslator *t) {
+  for (int slot = 0; slot < t->depth; slot++) {
+    materialize(t, slot);
+  }
+}
+
+// returns the register holding the value of `slot`
+static int operandRegister(RegisterTranslator *t, int slot) {
+  if (t->stack[slot].type == OPERAND_CONSTANT) {
+    materialize(t, slot);
+  }
+  return t->stack[slot].index;
+}
+
+// emit the opcode of an instruction writing its result into a new slot
+static void emitPushingOp(RegisterTranslator *t, uint8_t op) {
+  int dest = t->depth;
+  invalidateRegister(t, dest);
+  emitRegisterOp(t, op);
+  t->lastDest = t->code->count;
+  emitRegister(t, dest);
+  useRegister(t, dest);
+}
+
+// push the result of the instruction emitted by `emitPushingOp()`
+static void pushResult(RegisterTranslator *t) {
+  int lastDest = t->lastDest;
+  pushOperand(t, OPERAND_REGISTER, t->depth);
+  t->lastDest = lastDest;
+}
+
+static void emitRegisterJump(RegisterTranslator *t, RegisterJump *jumps,
+                             int *jumpCount, int target) {
+  jumps[*jumpCount].operand = t->code->count;
+  jumps[*jumpCount].end = t->code->count + 2;
+  jumps[*jumpCount].target = target;
+  (*jumpCount)++;
+  emitRegister(t, 0xff);
+  emitRegister(t, 0xff);
+}
+
+// `R[slot] = value on top of the stack`, for OP_SET_LOCAL
+static void storeLocal(RegisterTranslator *t, int slot) {
+  int top = t->depth - 1;
+  bool isRead = false; // by another operand than the top one
+  for (int i = 0; i < top; i++) {
+    if (i != slot && t->stack[i].type == OPERAND_REGISTER &&
+        t->stack[i].index == slot) {
+      isRead = true;
+    }
+  }
+  if (!isRead && t->lastDest != -1 && isMaterialized(t, top) &&
+      t->code->code[t->lastDest] == top) {
+    // the value was just computed: write it directly to the local
+    t->code->code[t->lastDest] = slot;
+    t->stack[top].index = slot;
+  } else {
+    invalidateRegister(t, slot);
+    Operand value = t->stack[top];
+    emitRegisterOp(t, value.type == OPERAND_REGISTER ? REG_MOVE : REG_LOADK);
+    emitRegister(t, slot);
+    emitRegister(t, value.index);
+  }
+  t->stack[slot].type = OPERAND_REGISTER;
+  t->stack[slot].index = slot;
+}
+
+// binary operator, `constantOp` is its variant with a constant right operand
+static void translateBinary(RegisterTranslator *t, uint8_t op,
+                            uint8_t constantOp) {
+  int left = operandRegister(t, t->depth - 2);
+  Operand right = t->stack[t->depth - 1];
+  if (right.type == OPERAND_REGISTER) {
+    constantOp = op;
+  }
+  t->depth -= 2;
+  emitPushingOp(t, constantOp);
+  emitRegister(t, left);
+  emitRegister(t, right.index);
+  pushResult(t);
+}
+
+static void translateUnary(RegisterTranslator *t, uint8_t op) {
+  int operand = operandRegister(t, t->depth - 1);
+  t->depth--;
+  emitPushingOp(t, op);
+  emitRegister(t, operand);
+  pushResult(t);
+}
+
+/**
+ * Fill the register code of `function` from its stack code.
+ * Returns false if the function needs more than 256 registers, or too long
+ * jumps.
+ */
+static bool emitRegisterCode(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  RegisterTranslator t;
+  t.chunk = chunk;
+  t.code = &chunk->registers;
+  t.depth = 0;
+  t.line = 0;
+  t.lastDest = -1;
+  t.failed = false;
+  t.code->count = 0;
+  t.code->registerCount = 0;
+  // slot 0 (closure or `this`) and the parameters
+  for (int i = 0; i <= function->arity; i++) {
+    pushOperand(&t, OPERAND_REGISTER, i);
+  }
+
+  int count = chunk->count;
+  uint8_t *code = chunk->code;
+  // stack depth at each jump target (-1 for other instructions)
+  int *targetDepths = ALLOCATE(int, count + 1);
+  int *newOffsets = ALLOCATE(int, count + 1);
+  RegisterJump *jumps = ALLOCATE(RegisterJump, count);
+  int jumpCount = 0;
+  for (int i = 0; i <= count; i++) {
+    targetDepths[i] = -1;
+  }
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (isJumpInstruction(code[offset])) {
+      // depth filled by the jump itself
+      targetDepths[jumpTarget(chunk, offset)] = -2;
+    }
+  }
+
+  bool reachable = true;
+  for (int offset = 0; offset < count && !t.failed;
+       offset += instructionLength(chunk, offset)) {
+    if (targetDepths[offset] != -1) {
+      if (reachable) {
+        materializeAll(&t);
+      } else {
+        // only reached by jumps: all values are in their slot. A target
+        // only reached by a later `OP_LOOP` (the increment clause of a
+        // `for`) starts at the depth of the jump skipping it.
+        int depth =
+            targetDepths[offset] >= 0 ? targetDepths[offset] : t.depth;
+        t.depth = 0;
+        for (int i = 0; i < depth; i++) {
+          pushOperand(&t, OPERAND_REGISTER, i);
+        }
+        reachable = true;
+      }
+      t.lastDest = -1;
+    }
+    newOffsets[offset] = t.code->count;
+    if (!reachable)
+      continue; // dead code, eg: the implicit return after a `return`
+
+    t.line = chunk->lines[offset];
+    uint8_t op = code[offset];
+    int top = t.depth - 1;
+    switch (op) {
+    case OP_CONSTANT:
+      pushOperand(&t, OPERAND_CONSTANT, code[offset + 1]);
+      break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      emitPushingOp(&t, op == OP_NIL    ? REG_LOADNIL
+                        : op == OP_TRUE ? REG_LOADTRUE
+                                        : REG_LOADFALSE);
+      pushResult(&t);
+      break;
+    case OP_POP:
+      t.depth--;
+      break;
+    case OP_GET_LOCAL: {
+      Operand local = t.stack[code[offset + 1]];
+      pushOperand(&t, local.type, local.index);
+      break;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      storeLocal(&t, code[offset + 1]);
+      if (op == OP_SET_LOCAL_POP)
+        t.depth--;
+      break;
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+      emitPushingOp(&t, op == OP_GET_GLOBAL ? REG_GET_GLOBAL : REG_GET_UPVALUE);
+      for (int i = 1; i < instructionLength(chunk, offset); i++) {
+        emitRegister(&t, code[offset + i]);
+      }
+      pushResult(&t);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_SET_UPVALUE: {
+      int value = operandRegister(&t, top);
+      emitRegisterOp(&t, op == OP_DEFINE_GLOBAL ? REG_DEFINE_GLOBAL
+                         : op == OP_SET_UPVALUE ? REG_SET_UPVALUE
+                                                : REG_SET_GLOBAL);
+      emitRegister(&t, value);
+      for (int i = 1; i < instructionLength(chunk, offset); i++) {
+        emitRegister(&t, code[offset + i]);
+      }
+      if (op == OP_DEFINE_GLOBAL || op == OP_SET_GLOBAL_POP)
+        t.depth--;
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      int object = operandRegister(&t, top);
+      t.depth--;
+      emitPushingOp(&t, REG_GET_PROPERTY);
+      emitRegister(&t, object);
+      emitRegister(&t, code[offset + 1]); // name
+      emitRegister(&t, code[offset + 2]); // cache
+      emitRegister(&t, code[offset + 3]);
+      pushResult(&t);
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      int object = operandRegister(&t, top - 1);
+      int value = operandRegister(&t, top);
+      emitRegisterOp(&t, REG_SET_PROPERTY);
+      emitRegister(&t, object);
+      emitRegister(&t, code[offset + 1]); // name
+      emitRegister(&t, code[offset + 2]); // cache
+      emitRegister(&t, code[offset + 3]);
+      emitRegister(&t, value);
+      // the assignment evaluates to the value
+      t.depth -= 2;
+      pushOperand(&t, OPERAND_REGISTER, value);
+      break;
+    }
+    case OP_GET_SUPER: {
+      int receiver = operandRegister(&t, top - 1);
+      int superClass = operandRegister(&t, top);
+      t.depth -= 2;
+      emitPushingOp(&t, REG_GET_SUPER);
+      emitRegister(&t, receiver);
+      emitRegister(&t, superClass);
+      emitRegister(&t, code[offset + 1]);
+      pushResult(&t);
+      break;
+    }
+    case OP_EQUAL:
+      translateBinary(&t, REG_EQUAL, REG_EQUAL_K);
+      break;
+    case OP_GREATER:
+      translateBinary(&t, REG_GREATER, REG_GREATER_K);
+      break;
+    case OP_LESS:
+      translateBinary(&t, REG_LESS, REG_LESS_K);
+      break;
+    case OP_ADD:
+      translateBinary(&t, REG_ADD, REG_ADD_K);
+      break;
+    case OP_SUBSTRACT:
+      translateBinary(&t, REG_SUBSTRACT, REG_SUBSTRACT_K);
+      break;
+    case OP_MULTIPLY:
+      translateBinary(&t, REG_MULTIPLY, REG_MULTIPLY_K);
+      break;
+    case OP_DIVIDE:
+      translateBinary(&t, REG_DIVIDE, REG_DIVIDE_K);
+      break;
+    case OP_ADD_CONSTANT:
+    case OP_SUBSTRACT_CONSTANT:
+      pushOperand(&t, OPERAND_CONSTANT, code[offset + 1]);
+      translateBinary(&t, op == OP_ADD_CONSTANT ? REG_ADD : REG_SUBSTRACT,
+                      op == OP_ADD_CONSTANT ? REG_ADD_K : REG_SUBSTRACT_K);
+      break;
+    case OP_NOT:
+      translateUnary(&t, REG_NOT);
+      break;
+    case OP_NEGATE:
+      translateUnary(&t, REG_NEGATE);
+      break;
+    case OP_PRINT: {
+      int value = operandRegister(&t, top);
+      emitRegisterOp(&t, REG_PRINT);
+      emitRegister(&t, value);
+      t.depth--;
+      break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE: {
+      int target = jumpTarget(chunk, offset);
+      materializeAll(&t);
+      emitRegisterOp(&t, op == OP_JUMP   ? REG_JUMP
+                         : op == OP_LOOP ? REG_LOOP
+                                         : REG_JUMP_IF_FALSE);
+      if (op == OP_JUMP_IF_FALSE) {
+        emitRegister(&t, top);
+      }
+      emitRegisterJump(&t, jumps, &jumpCount, target);
+      targetDepths[target] = t.depth;
+      reachable = op == OP_JUMP_IF_FALSE;
+      break;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE: {
+      int target = jumpTarget(chunk, offset);
+      int condition = operandRegister(&t, top);
+      t.depth--;
+      materializeAll(&t);
+      emitRegisterOp(&t, op == OP_POP_JUMP_IF_FALSE ? REG_JUMP_IF_FALSE
+                                                    : REG_JUMP_IF_TRUE);
+      emitRegister(&t, condition);
+      emitRegisterJump(&t, jumps, &jumpCount, target);
+      targetDepths[target] = t.depth;
+      break;
+    }
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER: {
+      int target = jumpTarget(chunk, offset);
+      int left = operandRegister(&t, top - 1);
+      Operand right = t.stack[top];
+      t.depth -= 2;
+      materializeAll(&t);
+      bool isLess = op == OP_JUMP_IF_NOT_LESS;
+      if (right.type == OPERAND_REGISTER) {
+        emitRegisterOp(&t, isLess ? REG_JUMP_IF_NOT_LESS
+                                  : REG_JUMP_IF_NOT_GREATER);
+      } else {
+        emitRegisterOp(&t, isLess ? REG_JUMP_IF_NOT_LESS_K
+                                  : REG_JUMP_IF_NOT_GREATER_K);
+      }
+      emitRegister(&t, left);
+      emitRegister(&t, right.index);
+      emitRegisterJump(&t, jumps, &jumpCount, target);
+      targetDepths[target] = t.depth;
+      break;
+    }
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE: {
+      bool isTail = op == OP_TAIL_CALL || op == OP_TAIL_INVOKE ||
+                    op == OP_TAIL_SUPER_INVOKE;
+      if (isTail) {
+        op = op == OP_TAIL_CALL     ? OP_CALL
+             : op == OP_TAIL_INVOKE ? OP_INVOKE
+                                    : OP_SUPER_INVOKE;
+      }
+      int argCount = code[offset + (op == OP_CALL ? 1 : 2)];
+      int superClass = -1;
+      if (op == OP_SUPER_INVOKE) {
+        superClass = operandRegister(&t, top);
+        t.depth--;
+      }
+      // the callee (or receiver) and the arguments are the first
+      // registers of the callee frame.
+      materializeAll(&t);
+      int callee = t.depth - argCount - 1;
+      if (isTail) {
+        // the `OP_RETURN` that follows stays, as dead code
+        emitRegisterOp(&t, op == OP_CALL     ? REG_TAIL_CALL
+                           : op == OP_INVOKE ? REG_TAIL_INVOKE
+                                             : REG_TAIL_SUPER_INVOKE);
+      } else {
+        emitRegisterOp(&t, op == OP_CALL     ? REG_CALL
+                           : op == OP_INVOKE ? REG_INVOKE
+                                             : REG_SUPER_INVOKE);
+      }
+      emitRegister(&t, callee);
+      for (int i = 1; i < instructionLength(chunk, offset); i++) {
+        emitRegister(&t, code[offset + i]);
+      }
+      if (op == OP_SUPER_INVOKE) {
+        emitRegister(&t, superClass);
+      }
+      t.depth = callee;
+      pushOperand(&t, OPERAND_REGISTER, callee);
+      break;
+    }
+    case OP_CLOSURE:
+      // captured locals must be in their slot
+      materializeAll(&t);
+      emitPushingOp(&t, REG_CLOSURE);
+      for (int i = 1; i < instructionLength(chunk, offset); i++) {
+        emitRegister(&t, code[offset + i]);
+      }
+      pushResult(&t);
+      break;
+    case OP_CLOSE_UPVALUE:
+      materializeAll(&t);
+      emitRegisterOp(&t, REG_CLOSE);
+      emitRegister(&t, top);
+      t.depth--;
+      break;
+    case OP_RETURN: {
+      int value = operandRegister(&t, top);
+      emitRegisterOp(&t, REG_RETURN);
+      emitRegister(&t, value);
+      reachable = false;
+      break;
+    }
+    case OP_CLASS:
+      emitPushingOp(&t, REG_CLASS);
+      emitRegister(&t, code[offset + 1]);
+      pushResult(&t);
+      break;
+    case OP_INHERIT:
+    case OP_METHOD: {
+      int klass = operandRegister(&t, top - 1);
+      int value = operandRegister(&t, top);
+      emitRegisterOp(&t, op == OP_INHERIT ? REG_INHERIT : REG_METHOD);
+      emitRegister(&t, klass);
+      emitRegister(&t, value);
+      if (op == OP_METHOD) {
+        emitRegister(&t, code[offset + 1]);
+      }
+      t.depth--;
+      break;
+    }
+    default:
+      // quickened instructions only appear once the chunk ran
+      t.failed = true;
+      break;
+    }
+  }
+  newOffsets[count] = t.code->count;
+
+  for (int i = 0; i < jumpCount && !t.failed; i++) {
+    RegisterJump *jump = &jumps[i];
+    int target = newOffsets[jump->target];
+    int distance = target >= jump->end ? target - jump->end
+                                       : jump->end - target;
+    if (distance > UINT16_MAX) {
+      t.failed = true;
+    }
+    t.code->code[jump->operand] = (distance >> 8) & 0xff;
+    t.code->code[jump->operand + 1] = distance & 0xff;
+  }
+
+  FREE_ARRAY(RegisterJump, jumps, count);
+  FREE_ARRAY(int, newOffsets, count + 1);
+  FREE_ARRAY(int, targetDepths, count + 1);
+  return !t.failed;
+}
+
 /**
  * returns the compiled function.
  */
@@ -276,11 +853,35 @@ static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
 
+#ifdef PEEPHOLE
+  if (!parser.hadError) {
+    optimizeChunk(currentChunk());
+  }
+#endif
+
+  if (!parser.hadError) {
+    // slot 0 and the parameters are on the stack when the call starts
+    function->stackSize =
+        maxStackDepth(currentChunk(), function->arity + 1);
+  }
+
+  if (vm.backend == BACKEND_REGISTER && !parser.hadError &&
+      !emitRegisterCode(function)) {
+    fprintf(stderr, "Function too large for the register backend, "
+                    "running the stack backend.\n");
+    vm.backend = BACKEND_STACK;
+  }
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
+    if (vm.backend == BACKEND_REGISTER) {
+      disassembleRegisterCode(currentChunk(), function->name != NULL
+                                                  ? function->name->chars
+                                                  : "<script>");
+    }
   }
 #endif
   current = current->enclosing;
@@ -307,6 +908,7 @@ static uint8_t argumentList();
 static void declaration();
 static void expression();
 static uint8_t identifierConstant(Token *name);
+static uint16_t identifierGlobal(Token *name);
 static ParseRule *getRule(TokenType type);
 static void parsePrecendence(Precedence precedence);
 static void statement();
@@ -364,6 +966,7 @@ static void binary(bool _canAssign) {
  */
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -384,11 +987,13 @@ static void dot(bool canAssign) {
     emitBytes(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
   } else {
     emitBytes(OP_GET_PROPERTY, name);
   }
+  emitInlineCache();
 }
 
 /**
@@ -452,8 +1057,8 @@ static void string(bool _canAssign) {
 
 /**
  * Resolve a variable "store" or "load",
- * * globals are resolved at runtime using their name (stored in the constant
- * array)
+ * * globals are resolved at compile time to their slot in the VM global
+ * values array, (they are checked for being defined at runtime)
  * * locals are resolved at compile time using their value index in the stack
  * * closure's variable (upvalues) are resolved at compile time using their
  * "upvalues"
@@ -470,10 +1075,14 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    // get var name in constant table
-    arg = identifierConstant(&name);
-    getOp = OP_GET_GLOBAL;
-    setOp = OP_SET_GLOBAL;
+    uint16_t global = identifierGlobal(&name);
+    if (canAssign && match(TOKEN_EQUAL)) {
+      expression();
+      emitGlobal(OP_SET_GLOBAL, global);
+    } else {
+      emitGlobal(OP_GET_GLOBAL, global);
+    }
+    return;
   }
 
   if (canAssign && match(TOKEN_EQUAL)) {
@@ -532,6 +1141,7 @@ static void super_(bool _canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
@@ -659,6 +1269,19 @@ static uint8_t identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+/**
+ * Resolve a global variable name to its slot index in `vm.globalValues`.
+ * The slot is shared by every chunk using this name.
+ */
+static uint16_t identifierGlobal(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   return (a->length == b->length) && memcmp(a->start, b->start, a->length) == 0;
 }
@@ -777,7 +1400,7 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
 
@@ -790,14 +1413,13 @@ static uint8_t parseVariable(const char *errorMessage) {
 
   // because globals can be used before (lexically) being
   // declared, and because this is a single pass compiler
-  // we need to look them up dynamically (at run time),
-  // using an HashMap, we store the "key" (variable name) in
-  // the constant array.
+  // we can't know whether they'll be defined: every global name
+  // gets a slot in the VM, which stays "undefined" until
+  // an `OP_DEFINE_GLOBAL` stores a value in it.
   //
-  // At runtime, an opcode tells the VM to load a
-  // constant value from the constant array, then read/write
-  // the value from/into the `vm.globals` hashmap
-  return identifierConstant(&parser.previous);
+  // At runtime, an opcode tells the VM to read/write the value
+  // from/into the slot, and to check that it's defined.
+  return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -809,7 +1431,7 @@ static void markInitialized() {
 /**
  * Emit instructions to create a variable binding.
  */
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   // if we are defining a local variable,
   // the value it binds to is already in the stack.
   // The value stack index is enough to define a local variable,
@@ -818,9 +1440,8 @@ static void defineVariable(uint8_t global) {
     markInitialized(); // But, we can mark it as "usable"
     return;
   }
-  // Global variables are defined by name,
-  // so we store the name in the constant table
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  // Global variables are defined by slot
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 /**
@@ -890,7 +1511,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -941,9 +1562,11 @@ static void classDeclaration(void) {
   Token className = parser.previous;
   uint8_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
+  uint16_t global =
+      current->scopeDepth > 0 ? 0 : identifierGlobal(&parser.previous);
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(global);
 
   // keep track of the current Class we're
   // compiling (if any)
@@ -998,7 +1621,7 @@ static void classDeclaration(void) {
  * parse function declaration, assumes "fun" has been consumed.
  */
 static void funDeclaration(void) {
-  uint8_t global = parseVariable("Expect function name");
+  uint16_t global = parseVariable("Expect function name");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -1008,7 +1631,7 @@ static void funDeclaration(void) {
  */
 static void varDeclaration() {
 
-  uint8_t global = parseVariable("Expect variable name.");
+  uint16_t global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1135,6 +1758,17 @@ static void returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // the returned value is a call: turn it into a tail call, the callee
+    // returns straight to our caller. Only if the call is the last
+    // instruction of the expression (eg: not in `return f() + 1;`).
+    Chunk *chunk = currentChunk();
+    int call = current->lastCall;
+    if (call != -1 && call + instructionLength(chunk, call) == chunk->count) {
+      uint8_t *op = &chunk->code[call];
+      *op = *op == OP_CALL     ? OP_TAIL_CALL
+            : *op == OP_INVOKE ? OP_TAIL_INVOKE
+                               : OP_TAIL_SUPER_INVOKE;
+    }
     emitByte(OP_RETURN);
   }
 }
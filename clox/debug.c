@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -38,6 +39,16 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+// global variable: slot index (16 bits) in `vm.globalValues`
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot =
+      (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
@@ -47,6 +58,30 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+// property access: constant (name) + inline cache index
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4;
+}
+
+// method invocation: constant (name) + arg count + inline cache index
+static int cachedInvokeInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache =
+      (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -65,19 +100,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_SUPER:
     return constantInstruction("OP_GET_SUPER", chunk, offset);
   case OP_POP:
@@ -115,9 +150,15 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
   case OP_INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return cachedInvokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+  case OP_TAIL_SUPER_INVOKE:
+    return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
   case OP_CLOSURE: {
     offset++; // consume closure byte
     uint8_t constant_idx = chunk->code[offset++];
@@ -144,8 +185,237 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+  case OP_SUBSTRACT_NUM:
+    return simpleInstruction("OP_SUBSTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_POP_JUMP_IF_TRUE:
+    return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS:
+    return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER:
+    return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+  case OP_ADD_CONSTANT:
+    return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+  case OP_SUBSTRACT_CONSTANT:
+    return constantInstruction("OP_SUBSTRACT_CONSTANT", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_SET_GLOBAL_POP:
+    return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset);
   default:
     printf("Unknown instruction %d\n", instruction);
     return offset + 1;
   }
 }
+
+/** returns a static string representing the `instruction` opcode.
+ */
+const char *opcodeName(uint8_t instruction) {
+#define AS_STR(op)                                                             \
+  case op:                                                                     \
+    return #op;
+  switch (instruction) {
+    AS_STR(OP_CONSTANT)
+    AS_STR(OP_NIL)
+    AS_STR(OP_FALSE)
+    AS_STR(OP_EQUAL)
+    AS_STR(OP_GET_GLOBAL)
+    AS_STR(OP_DEFINE_GLOBAL)
+    AS_STR(OP_SET_GLOBAL)
+    AS_STR(OP_GET_UPVALUE)
+    AS_STR(OP_SET_UPVALUE)
+    AS_STR(OP_GET_PROPERTY)
+    AS_STR(OP_SET_PROPERTY)
+    AS_STR(OP_GET_SUPER)
+    AS_STR(OP_POP)
+    AS_STR(OP_GET_LOCAL)
+    AS_STR(OP_SET_LOCAL)
+    AS_STR(OP_GREATER)
+    AS_STR(OP_LESS)
+    AS_STR(OP_TRUE)
+    AS_STR(OP_ADD)
+    AS_STR(OP_SUBSTRACT)
+    AS_STR(OP_MULTIPLY)
+    AS_STR(OP_DIVIDE)
+    AS_STR(OP_NOT)
+    AS_STR(OP_NEGATE)
+    AS_STR(OP_PRINT)
+    AS_STR(OP_JUMP)
+    AS_STR(OP_JUMP_IF_FALSE)
+    AS_STR(OP_LOOP)
+    AS_STR(OP_CALL)
+    AS_STR(OP_INVOKE)
+    AS_STR(OP_SUPER_INVOKE)
+    AS_STR(OP_TAIL_CALL)
+    AS_STR(OP_TAIL_INVOKE)
+    AS_STR(OP_TAIL_SUPER_INVOKE)
+    AS_STR(OP_CLOSURE)
+    AS_STR(OP_CLOSE_UPVALUE)
+    AS_STR(OP_RETURN)
+    AS_STR(OP_CLASS)
+    AS_STR(OP_INHERIT)
+    AS_STR(OP_METHOD)
+    AS_STR(OP_ADD_NUM)
+    AS_STR(OP_ADD_STR)
+    AS_STR(OP_SUBSTRACT_NUM)
+    AS_STR(OP_MULTIPLY_NUM)
+    AS_STR(OP_DIVIDE_NUM)
+    AS_STR(OP_GREATER_NUM)
+    AS_STR(OP_LESS_NUM)
+    AS_STR(OP_POP_JUMP_IF_FALSE)
+    AS_STR(OP_POP_JUMP_IF_TRUE)
+    AS_STR(OP_JUMP_IF_NOT_LESS)
+    AS_STR(OP_JUMP_IF_NOT_GREATER)
+    AS_STR(OP_ADD_CONSTANT)
+    AS_STR(OP_SUBSTRACT_CONSTANT)
+    AS_STR(OP_SET_LOCAL_POP)
+    AS_STR(OP_SET_GLOBAL_POP)
+  default:
+    return "Unknown";
+  }
+#undef AS_STR
+}
+
+// name and operands of each register instruction, one character per
+// operand: `r` register, `k` constant, `b` byte, `g` global slot (16 bits),
+// `c` inline cache (16 bits), `j`/`l` forward/backward jump (16 bits).
+static const struct {
+  const char *name;
+  const char *operands;
+} registerInstructions[] = {
+    [REG_MOVE] = {"REG_MOVE", "rr"},
+    [REG_LOADK] = {"REG_LOADK", "rk"},
+    [REG_LOADNIL] = {"REG_LOADNIL", "r"},
+    [REG_LOADTRUE] = {"REG_LOADTRUE", "r"},
+    [REG_LOADFALSE] = {"REG_LOADFALSE", "r"},
+    [REG_GET_GLOBAL] = {"REG_GET_GLOBAL", "rg"},
+    [REG_DEFINE_GLOBAL] = {"REG_DEFINE_GLOBAL", "rg"},
+    [REG_SET_GLOBAL] = {"REG_SET_GLOBAL", "rg"},
+    [REG_GET_UPVALUE] = {"REG_GET_UPVALUE", "rb"},
+    [REG_SET_UPVALUE] = {"REG_SET_UPVALUE", "rb"},
+    [REG_GET_PROPERTY] = {"REG_GET_PROPERTY", "rrkc"},
+    [REG_SET_PROPERTY] = {"REG_SET_PROPERTY", "rkcr"},
+    [REG_GET_SUPER] = {"REG_GET_SUPER", "rrrk"},
+    [REG_EQUAL] = {"REG_EQUAL", "rrr"},
+    [REG_GREATER] = {"REG_GREATER", "rrr"},
+    [REG_LESS] = {"REG_LESS", "rrr"},
+    [REG_ADD] = {"REG_ADD", "rrr"},
+    [REG_SUBSTRACT] = {"REG_SUBSTRACT", "rrr"},
+    [REG_MULTIPLY] = {"REG_MULTIPLY", "rrr"},
+    [REG_DIVIDE] = {"REG_DIVIDE", "rrr"},
+    [REG_EQUAL_K] = {"REG_EQUAL_K", "rrk"},
+    [REG_GREATER_K] = {"REG_GREATER_K", "rrk"},
+    [REG_LESS_K] = {"REG_LESS_K", "rrk"},
+    [REG_ADD_K] = {"REG_ADD_K", "rrk"},
+    [REG_SUBSTRACT_K] = {"REG_SUBSTRACT_K", "rrk"},
+    [REG_MULTIPLY_K] = {"REG_MULTIPLY_K", "rrk"},
+    [REG_DIVIDE_K] = {"REG_DIVIDE_K", "rrk"},
+    [REG_NOT] = {"REG_NOT", "rr"},
+    [REG_NEGATE] = {"REG_NEGATE", "rr"},
+    [REG_PRINT] = {"REG_PRINT", "r"},
+    [REG_JUMP] = {"REG_JUMP", "j"},
+    [REG_LOOP] = {"REG_LOOP", "l"},
+    [REG_JUMP_IF_FALSE] = {"REG_JUMP_IF_FALSE", "rj"},
+    [REG_JUMP_IF_TRUE] = {"REG_JUMP_IF_TRUE", "rj"},
+    [REG_JUMP_IF_NOT_LESS] = {"REG_JUMP_IF_NOT_LESS", "rrj"},
+    [REG_JUMP_IF_NOT_LESS_K] = {"REG_JUMP_IF_NOT_LESS_K", "rkj"},
+    [REG_JUMP_IF_NOT_GREATER] = {"REG_JUMP_IF_NOT_GREATER", "rrj"},
+    [REG_JUMP_IF_NOT_GREATER_K] = {"REG_JUMP_IF_NOT_GREATER_K", "rkj"},
+    [REG_CALL] = {"REG_CALL", "rb"},
+    [REG_INVOKE] = {"REG_INVOKE", "rkbc"},
+    [REG_SUPER_INVOKE] = {"REG_SUPER_INVOKE", "rkbr"},
+    [REG_TAIL_CALL] = {"REG_TAIL_CALL", "rb"},
+    [REG_TAIL_INVOKE] = {"REG_TAIL_INVOKE", "rkbc"},
+    [REG_TAIL_SUPER_INVOKE] = {"REG_TAIL_SUPER_INVOKE", "rkbr"},
+    [REG_CLOSURE] = {"REG_CLOSURE", "rk"},
+    [REG_CLOSE] = {"REG_CLOSE", "r"},
+    [REG_RETURN] = {"REG_RETURN", "r"},
+    [REG_CLASS] = {"REG_CLASS", "rk"},
+    [REG_INHERIT] = {"REG_INHERIT", "rr"},
+    [REG_METHOD] = {"REG_METHOD", "rrk"},
+};
+
+void disassembleRegisterCode(Chunk *chunk, const char *name) {
+  printf("== %s (%d registers) ==\n", name, chunk->registers.registerCount);
+  for (int offset = 0; offset < chunk->registers.count;) {
+    offset = disassembleRegisterInstruction(chunk, offset);
+  }
+}
+
+int disassembleRegisterInstruction(Chunk *chunk, int offset) {
+  RegisterCode *code = &chunk->registers;
+  printf("%04d ", offset);
+  if (offset > 0 && code->lines[offset] == code->lines[offset - 1]) {
+    printf("   | ");
+  } else {
+    printf("%4d ", code->lines[offset]);
+  }
+  uint8_t instruction = code->code[offset];
+  if (instruction >= REG_COUNT) {
+    printf("Unknown instruction %d\n", instruction);
+    return offset + 1;
+  }
+  int start = offset++;
+  printf("%-25s", registerInstructions[instruction].name);
+  for (const char *operand = registerInstructions[instruction].operands;
+       *operand != '\0'; operand++) {
+    uint8_t byte = code->code[offset++];
+    uint16_t wide = 0; // 16 bits operands
+    if (*operand == 'g' || *operand == 'c' || *operand == 'j' ||
+        *operand == 'l') {
+      wide = (uint16_t)((byte << 8) | code->code[offset++]);
+    }
+    switch (*operand) {
+    case 'r':
+      printf(" R%d", byte);
+      break;
+    case 'b':
+      printf(" %d", byte);
+      break;
+    case 'k':
+      printf(" K%d '", byte);
+      printValue(chunk->constants.values[byte]);
+      printf("'");
+      break;
+    case 'g':
+      printf(" G%d '", wide);
+      printValue(vm.globalNames.values[wide]);
+      printf("'");
+      break;
+    case 'c':
+      printf(" (cache %d)", wide);
+      break;
+    case 'j':
+    case 'l':
+      // jumps are relative to the end of the instruction, which
+      // always is their last operand.
+      printf(" -> %d", *operand == 'j' ? offset + wide : offset - wide);
+      break;
+    }
+  }
+  printf("\n");
+  if (instruction == REG_CLOSURE) {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[code->code[start + 2]]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+      int isLocal = code->code[offset++];
+      int index = code->code[offset++];
+      printf("%04d    |                     %s %d\n", offset - 2,
+             isLocal ? "local" : "upvalue", index);
+    }
+  }
+  return offset;
+}
@@ -5,5 +5,8 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+const char *opcodeName(uint8_t instruction);
+void disassembleRegisterCode(Chunk *chunk, const char *name);
+int disassembleRegisterInstruction(Chunk *chunk, int offset);
 
 #endif
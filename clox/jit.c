@@ -0,0 +1,949 @@
+#include "common.h"
+
+#ifdef JIT
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "memory.h"
+
+/**
+ * Baseline JIT: translates the bytecode of a hot function into x86-64
+ * machine code, one template per instruction.
+ *
+ * The machine code keeps the exact stack layout of the interpreter, so
+ * it can take over a frame at any instruction (eg: in the middle of a hot
+ * loop), and fall back to the interpreter for the functions it calls.
+ * Simple instructions (stack moves, locals, globals, numbers arithmetic
+ * and comparisons, jumps) are inlined. Everything else (calls,
+ * properties, allocations, errors) calls the C helpers of vm.c.
+ *
+ * While the machine code runs, some interpreter state lives in callee
+ * saved registers:
+ *
+ * * rbx: `vm.stackTop`, stored before calling a helper, reloaded after
+ * * r12: `frame->slots`
+ * * r13: the constants of the chunk
+ * * r14: the `CallFrame` running
+ * * r15: offset of that frame in `vm.frames`
+ *
+ * A helper may grow (and move) the stack and the frames: r12 and r14 are
+ * reloaded after each one, from r15.
+ *
+ * `frame->ip` is only stored before calling a helper, for it to report the
+ * line of a runtime error.
+ *
+ * The minor collection moves the young objects (see memory.c): the machine
+ * code only keeps values in the VM stack, and collects the nursery at the
+ * same safepoints as the interpreter: backward jumps, and the exit (returns
+ * and tail calls).
+ */
+
+typedef InterpretResult (*JitFunction)(size_t frameOffset, uint8_t *entry);
+
+typedef enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+} Register;
+
+// condition codes, for `jcc` and `setcc`
+typedef enum {
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_NP = 0xb,
+} Condition;
+
+// a rel32 operand waiting for the offset of its target
+typedef struct {
+  int patch;  // offset of the rel32 in the machine code
+  int target; // offset of the target, in the chunk
+} JitJump;
+
+typedef struct {
+  Chunk *chunk;
+  uint8_t *code; // machine code, not executable yet
+  int count;
+  int capacity;
+  JitJump *jumps; // jumps to instructions
+  int jumpCount;
+  int jumpCapacity;
+  int *errorJumps; // jumps to the runtime error exit
+  int errorCount;
+  int errorCapacity;
+} Assembler;
+
+static void emitByte(Assembler *as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    int oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emitCode(Assembler *as, const uint8_t *bytes, int length) {
+  for (int i = 0; i < length; i++) {
+    emitByte(as, bytes[i]);
+  }
+}
+
+#define EMIT(as, ...)                                                          \
+  emitCode((as), (const uint8_t[]){__VA_ARGS__},                               \
+           sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(as, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emitByte(as, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void patch32(Assembler *as, int offset, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    as->code[offset + i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+// REX prefix with the W bit (64 bits operands)
+static void emitRex(Assembler *as, int reg, int rm) {
+  emitByte(as, 0x48 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+}
+
+// ModRM addressing `[base + disp32]`
+static void emitMemory(Assembler *as, int reg, Register base, int32_t disp) {
+  emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == 4) {
+    emitByte(as, 0x24); // rsp and r12 need a SIB byte
+  }
+  emit32(as, (uint32_t)disp);
+}
+
+// mov reg, imm64
+static void emitMovImm(Assembler *as, Register reg, uint64_t value) {
+  emitRex(as, 0, reg);
+  emitByte(as, 0xb8 + (reg & 7));
+  emit64(as, value);
+}
+
+// mov reg, [base + disp]
+static void emitLoad(Assembler *as, Register reg, Register base,
+                     int32_t disp) {
+  emitRex(as, reg, base);
+  emitByte(as, 0x8b);
+  emitMemory(as, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void emitStore(Assembler *as, Register base, int32_t disp,
+                      Register reg) {
+  emitRex(as, reg, base);
+  emitByte(as, 0x89);
+  emitMemory(as, reg, base, disp);
+}
+
+// `op dst, src` for the register to register forms of mov, add, and, cmp
+#define X86_MOV 0x89
+#define X86_ADD 0x01
+#define X86_AND 0x21
+#define X86_CMP 0x39
+#define X86_OR 0x09
+static void emitAlu(Assembler *as, uint8_t op, Register dst, Register src) {
+  emitRex(as, src, dst);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// lea reg, [base + disp]
+static void emitLea(Assembler *as, Register reg, Register base, int32_t disp) {
+  emitRex(as, reg, base);
+  emitByte(as, 0x8d);
+  emitMemory(as, reg, base, disp);
+}
+
+// add/sub rbx, imm32: moves the stack top
+static void emitMoveStackTop(Assembler *as, int slots) {
+  EMIT(as, 0x48, 0x81, slots >= 0 ? 0xc3 : 0xeb);
+  emit32(as, (uint32_t)(8 * (slots >= 0 ? slots : -slots)));
+}
+
+// movq xmm, reg
+static void emitToXmm(Assembler *as, int xmm, Register reg) {
+  emitByte(as, 0x66);
+  emitRex(as, 0, reg);
+  EMIT(as, 0x0f, 0x6e, 0xc0 | (xmm << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void emitFromXmm(Assembler *as, Register reg, int xmm) {
+  emitByte(as, 0x66);
+  emitRex(as, 0, reg);
+  EMIT(as, 0x0f, 0x7e, 0xc0 | (xmm << 3) | (reg & 7));
+}
+
+// ucomisd xmm(a), xmm(b)
+static void emitCompareXmm(Assembler *as, int a, int b) {
+  EMIT(as, 0x66, 0x0f, 0x2e, 0xc0 | (a << 3) | b);
+}
+
+// setcc reg8 (al, cl or dl)
+static void emitSet(Assembler *as, Condition cc, Register reg) {
+  EMIT(as, 0x0f, 0x90 | cc, 0xc0 | reg);
+}
+
+// jcc rel32, returns the offset of the rel32 to patch
+static int emitJcc(Assembler *as, Condition cc) {
+  EMIT(as, 0x0f, 0x80 | cc);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+// jmp rel32, returns the offset of the rel32 to patch
+static int emitJmp(Assembler *as) {
+  emitByte(as, 0xe9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+// make the jump whose rel32 is at `patch` land here
+static void patchHere(Assembler *as, int patch) {
+  patch32(as, patch, (uint32_t)(as->count - (patch + 4)));
+}
+
+// make the jump whose rel32 is at `patch` land on the instruction `target`
+static void jumpTo(Assembler *as, int patch, int target) {
+  if (as->jumpCapacity < as->jumpCount + 1) {
+    int oldCapacity = as->jumpCapacity;
+    as->jumpCapacity = GROW_CAPACITY(oldCapacity);
+    as->jumps =
+        GROW_ARRAY(JitJump, as->jumps, oldCapacity, as->jumpCapacity);
+  }
+  as->jumps[as->jumpCount].patch = patch;
+  as->jumps[as->jumpCount].target = target;
+  as->jumpCount++;
+}
+
+// make the jump whose rel32 is at `patch` exit with a runtime error
+static void jumpToError(Assembler *as, int patch) {
+  if (as->errorCapacity < as->errorCount + 1) {
+    int oldCapacity = as->errorCapacity;
+    as->errorCapacity = GROW_CAPACITY(oldCapacity);
+    as->errorJumps =
+        GROW_ARRAY(int, as->errorJumps, oldCapacity, as->errorCapacity);
+  }
+  as->errorJumps[as->errorCount++] = patch;
+}
+
+// push rax
+static void emitPush(Assembler *as) {
+  emitStore(as, RBX, 0, RAX);
+  emitMoveStackTop(as, 1);
+}
+
+// jump to the rel32 returned if `reg` isn't a number (clobbers rsi)
+static int emitIfNotNumber(Assembler *as, Register reg) {
+  emitMovImm(as, RDX, QNAN);
+  emitAlu(as, X86_MOV, RSI, reg);
+  emitAlu(as, X86_AND, RSI, RDX);
+  emitAlu(as, X86_CMP, RSI, RDX);
+  return emitJcc(as, CC_E);
+}
+
+// write back the interpreter state a helper might read: the stack top,
+// and the instruction pointer (`next` is the offset of the next
+// instruction) for the line of runtime errors.
+static void emitSync(Assembler *as, int next) {
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitStore(as, RAX, 0, RBX);
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + next));
+  emitStore(as, R14, offsetof(CallFrame, ip), RAX);
+}
+
+// (re)load r14 and r12, the frame and its slots
+static void emitLoadFrame(Assembler *as) {
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.frames);
+  emitLoad(as, R14, RAX, 0);
+  emitAlu(as, X86_ADD, R14, R15);
+  emitLoad(as, R12, R14, offsetof(CallFrame, slots));
+}
+
+// call a helper (its arguments already set), exit if it returns false
+static void emitCallHelper(Assembler *as, void *helper) {
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xff, 0xd0);       // call rax
+  EMIT(as, 0x84, 0xc0);       // test al, al
+  jumpToError(as, emitJcc(as, CC_E));
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitLoad(as, RBX, RAX, 0);
+  emitLoadFrame(as);
+}
+
+// mov edi/esi, imm32
+static void emitIntArgument(Assembler *as, Register reg, int32_t value) {
+  emitByte(as, 0xb8 + reg);
+  emit32(as, (uint32_t)value);
+}
+
+// mov rdi, constants[index]
+static void emitConstantArgument(Assembler *as, Register reg, int index) {
+  emitLoad(as, reg, R13, index * (int)sizeof(Value));
+}
+
+// report `message` as a runtime error, and exit
+static void emitError(Assembler *as, int next, const char *message) {
+  emitSync(as, next);
+  emitMovImm(as, RDI, (uint64_t)(uintptr_t)message);
+  emitCallHelper(as, jitRuntimeError);
+}
+
+// `a op b` on the 2 numbers on top of the stack, `op` is the SSE2
+// opcode (`addsd` and co)
+static void emitArithmetic(Assembler *as, uint8_t op, int next) {
+  emitLoad(as, RAX, RBX, -16);
+  emitLoad(as, RCX, RBX, -8);
+  int notNumber = emitIfNotNumber(as, RAX);
+  int notNumber2 = emitIfNotNumber(as, RCX);
+  emitToXmm(as, 0, RAX);
+  emitToXmm(as, 1, RCX);
+  EMIT(as, 0xf2, 0x0f, op, 0xc1); // op xmm0, xmm1
+  emitFromXmm(as, RAX, 0);
+  emitStore(as, RBX, -16, RAX);
+  emitMoveStackTop(as, -1);
+  int done = emitJmp(as);
+  patchHere(as, notNumber);
+  patchHere(as, notNumber2);
+  if (op == 0x58) {
+    // strings concatenation, or error
+    emitSync(as, next);
+    emitCallHelper(as, jitAdd);
+  } else {
+    emitError(as, next, "Operands must be numbers");
+  }
+  patchHere(as, done);
+}
+
+// `a < b` or `a > b` on the 2 numbers on top of the stack
+static void emitComparison(Assembler *as, bool isLess, int next) {
+  emitLoad(as, RAX, RBX, -16);
+  emitLoad(as, RCX, RBX, -8);
+  int notNumber = emitIfNotNumber(as, RAX);
+  int notNumber2 = emitIfNotNumber(as, RCX);
+  emitToXmm(as, 0, RAX);
+  emitToXmm(as, 1, RCX);
+  // `a < b` is `b > a`, and "above" is false for NaNs
+  if (isLess) {
+    emitCompareXmm(as, 1, 0);
+  } else {
+    emitCompareXmm(as, 0, 1);
+  }
+  emitSet(as, CC_A, RAX);
+  int done = emitJmp(as);
+  patchHere(as, notNumber);
+  patchHere(as, notNumber2);
+  emitError(as, next, "Operands must be numbers");
+  patchHere(as, done);
+  // true and false only differ by their lowest bit
+  EMIT(as, 0x0f, 0xb6, 0xc0); // movzx eax, al
+  emitMovImm(as, RCX, FALSE_VAL);
+  emitAlu(as, X86_ADD, RAX, RCX);
+  emitStore(as, RBX, -16, RAX);
+  emitMoveStackTop(as, -1);
+}
+
+// pop the 2 numbers on top of the stack, jump to `target` if `!(a < b)`
+// (or `!(a > b)`)
+static void emitCompareJump(Assembler *as, bool isLess, int target,
+                            int next) {
+  emitLoad(as, RAX, RBX, -16);
+  emitLoad(as, RCX, RBX, -8);
+  int notNumber = emitIfNotNumber(as, RAX);
+  int notNumber2 = emitIfNotNumber(as, RCX);
+  emitMoveStackTop(as, -2);
+  emitToXmm(as, 0, RAX);
+  emitToXmm(as, 1, RCX);
+  if (isLess) {
+    emitCompareXmm(as, 1, 0);
+  } else {
+    emitCompareXmm(as, 0, 1);
+  }
+  jumpTo(as, emitJcc(as, CC_BE), target);
+  int done = emitJmp(as);
+  patchHere(as, notNumber);
+  patchHere(as, notNumber2);
+  emitError(as, next, "Operands must be numbers");
+  patchHere(as, done);
+}
+
+// `a op constant` on the number on top of the stack
+static void emitArithmeticConstant(Assembler *as, uint8_t op, int constant,
+                                   int next, const char *message) {
+  emitLoad(as, RAX, RBX, -8);
+  int notNumber = emitIfNotNumber(as, RAX);
+  emitToXmm(as, 0, RAX);
+  emitLoad(as, RCX, R13, constant * (int)sizeof(Value));
+  emitToXmm(as, 1, RCX);
+  EMIT(as, 0xf2, 0x0f, op, 0xc1);
+  emitFromXmm(as, RAX, 0);
+  emitStore(as, RBX, -8, RAX);
+  int done = emitJmp(as);
+  patchHere(as, notNumber);
+  emitError(as, next, message);
+  patchHere(as, done);
+}
+
+// jump to `target` if rax is falsey (nil or false)
+static void emitJumpIfFalsey(Assembler *as, int target) {
+  emitMovImm(as, RCX, NIL_VAL);
+  emitAlu(as, X86_CMP, RAX, RCX);
+  jumpTo(as, emitJcc(as, CC_E), target);
+  emitMovImm(as, RCX, FALSE_VAL);
+  emitAlu(as, X86_CMP, RAX, RCX);
+  jumpTo(as, emitJcc(as, CC_E), target);
+}
+
+// rax = address of the global variable `slot`, jump to the rel32
+// returned if it isn't defined (clobbers rcx, rdx)
+static int emitGlobalAddress(Assembler *as, int slot) {
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  emitLoad(as, RAX, RAX, 0);
+  EMIT(as, 0x48, 0x05); // add rax, imm32
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+  emitLoad(as, RCX, RAX, 0);
+  emitMovImm(as, RDX, UNDEFINED_VAL);
+  emitAlu(as, X86_CMP, RCX, RDX);
+  return emitJcc(as, CC_E);
+}
+
+static void emitUndefinedVariable(Assembler *as, int slot, int next) {
+  emitSync(as, next);
+  emitIntArgument(as, RDI, slot);
+  emitCallHelper(as, jitUndefinedVariable);
+}
+
+// rax = address of the upvalue `index` of the running closure
+static void emitUpvalueAddress(Assembler *as, int index) {
+  emitLoad(as, RAX, R14, offsetof(CallFrame, closure));
+  emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+  emitLoad(as, RAX, RAX, index * (int)sizeof(ObjUpvalue *));
+  emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void emitPrologue(Assembler *as) {
+  // push rbx, r12, r13, r14, r15: also aligns the stack for the calls
+  EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+  emitAlu(as, X86_MOV, R15, RDI);
+  emitLoadFrame(as);
+  emitMovImm(as, R13, (uint64_t)(uintptr_t)as->chunk->constants.values);
+  emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitLoad(as, RBX, RAX, 0);
+  EMIT(as, 0xff, 0xe6); // jmp rsi: the entry instruction
+}
+
+// returns the offset of the epilogue, eax holds the result
+static int emitEpilogue(Assembler *as) {
+  int epilogue = as->count;
+  EMIT(as, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+  return epilogue;
+}
+
+/**
+ * Emit the template of the instruction at `offset`.
+ * Returns false if the instruction isn't supported.
+ */
+static bool emitInstruction(Assembler *as, int offset, int *returns,
+                            int *returnCount) {
+  uint8_t *code = as->chunk->code;
+  int next = offset + instructionLength(as->chunk, offset);
+  switch (code[offset]) {
+  case OP_CONSTANT:
+    emitLoad(as, RAX, R13, code[offset + 1] * (int)sizeof(Value));
+    emitPush(as);
+    break;
+  case OP_NIL:
+    emitMovImm(as, RAX, NIL_VAL);
+    emitPush(as);
+    break;
+  case OP_TRUE:
+    emitMovImm(as, RAX, TRUE_VAL);
+    emitPush(as);
+    break;
+  case OP_FALSE:
+    emitMovImm(as, RAX, FALSE_VAL);
+    emitPush(as);
+    break;
+  case OP_POP:
+    emitMoveStackTop(as, -1);
+    break;
+  case OP_GET_LOCAL:
+    emitLoad(as, RAX, R12, code[offset + 1] * (int)sizeof(Value));
+    emitPush(as);
+    break;
+  case OP_SET_LOCAL:
+    emitLoad(as, RAX, RBX, -8);
+    emitStore(as, R12, code[offset + 1] * (int)sizeof(Value), RAX);
+    break;
+  case OP_SET_LOCAL_POP:
+    emitMoveStackTop(as, -1);
+    emitLoad(as, RAX, RBX, 0);
+    emitStore(as, R12, code[offset + 1] * (int)sizeof(Value), RAX);
+    break;
+  case OP_GET_GLOBAL: {
+    int slot = (code[offset + 1] << 8) | code[offset + 2];
+    int undefined = emitGlobalAddress(as, slot);
+    emitAlu(as, X86_MOV, RAX, RCX);
+    emitPush(as);
+    int done = emitJmp(as);
+    patchHere(as, undefined);
+    emitUndefinedVariable(as, slot, next);
+    patchHere(as, done);
+    break;
+  }
+  case OP_DEFINE_GLOBAL: {
+    int slot = (code[offset + 1] << 8) | code[offset + 2];
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitLoad(as, RAX, RAX, 0);
+    emitMoveStackTop(as, -1);
+    emitLoad(as, RCX, RBX, 0);
+    emitStore(as, RAX, slot * (int)sizeof(Value), RCX);
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_POP: {
+    int slot = (code[offset + 1] << 8) | code[offset + 2];
+    int undefined = emitGlobalAddress(as, slot);
+    emitLoad(as, RCX, RBX, -8);
+    emitStore(as, RAX, 0, RCX);
+    if (code[offset] == OP_SET_GLOBAL_POP) {
+      emitMoveStackTop(as, -1);
+    }
+    int done = emitJmp(as);
+    patchHere(as, undefined);
+    emitUndefinedVariable(as, slot, next);
+    patchHere(as, done);
+    break;
+  }
+  case OP_GET_UPVALUE:
+    emitUpvalueAddress(as, code[offset + 1]);
+    emitLoad(as, RAX, RAX, 0);
+    emitPush(as);
+    break;
+  case OP_SET_UPVALUE: {
+    // the barriers are only needed to store an object, or while marking
+    // concurrently: the helper stores then.
+    emitLoad(as, RCX, RBX, -8);
+    emitMovImm(as, RDX, SIGN_BIT | QNAN);
+    emitAlu(as, X86_MOV, RSI, RCX);
+    emitAlu(as, X86_AND, RSI, RDX);
+    emitAlu(as, X86_CMP, RSI, RDX);
+    int isObject = emitJcc(as, CC_E);
+#ifdef CONCURRENT_GC
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.gcPhase);
+    EMIT(as, 0x83, 0x38, GC_CONCURRENT_MARK); // cmp dword [rax], imm8
+    int isMarking = emitJcc(as, CC_E);
+#endif
+    emitUpvalueAddress(as, code[offset + 1]);
+    emitStore(as, RAX, 0, RCX);
+    int done = emitJmp(as);
+    patchHere(as, isObject);
+#ifdef CONCURRENT_GC
+    patchHere(as, isMarking);
+#endif
+    emitSync(as, next);
+    emitIntArgument(as, RDI, code[offset + 1]);
+    emitCallHelper(as, jitSetUpvalue);
+    patchHere(as, done);
+    break;
+  }
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY: {
+    InlineCache *cache =
+        &as->chunk->caches[(code[offset + 2] << 8) | code[offset + 3]];
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitMovImm(as, RSI, (uint64_t)(uintptr_t)cache);
+    emitCallHelper(as, code[offset] == OP_GET_PROPERTY ? jitGetProperty
+                                                       : jitSetProperty);
+    break;
+  }
+  case OP_GET_SUPER:
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitCallHelper(as, jitGetSuper);
+    break;
+  case OP_EQUAL: {
+    emitLoad(as, RAX, RBX, -16);
+    emitLoad(as, RCX, RBX, -8);
+    int notNumber = emitIfNotNumber(as, RAX);
+    int notNumber2 = emitIfNotNumber(as, RCX);
+    // numbers: compare them as doubles (NaN isn't equal to itself)
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RCX);
+    emitCompareXmm(as, 0, 1);
+    emitSet(as, CC_E, RAX);
+    emitSet(as, CC_NP, RCX);
+    EMIT(as, 0x20, 0xc8); // and al, cl
+    int done = emitJmp(as);
+    // otherwise, compare their bits
+    patchHere(as, notNumber);
+    patchHere(as, notNumber2);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    int sameBits = emitJcc(as, CC_E);
+    // two different objects: the helper compares them, they may be equal
+    // strings (a rope and the string it flattens to)
+    emitAlu(as, X86_AND, RAX, RCX);
+    emitMovImm(as, RDX, SIGN_BIT | QNAN);
+    emitAlu(as, X86_AND, RAX, RDX);
+    emitAlu(as, X86_CMP, RAX, RDX);
+    int notObjects = emitJcc(as, CC_NE);
+    emitSync(as, next);
+    emitCallHelper(as, jitEqual);
+    int compared = emitJmp(as);
+    // ZF is still set for the same bits, clear otherwise
+    patchHere(as, notObjects);
+    patchHere(as, sameBits);
+    emitSet(as, CC_E, RAX);
+    patchHere(as, done);
+    EMIT(as, 0x0f, 0xb6, 0xc0); // movzx eax, al
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitAlu(as, X86_ADD, RAX, RCX);
+    emitStore(as, RBX, -16, RAX);
+    emitMoveStackTop(as, -1);
+    patchHere(as, compared);
+    break;
+  }
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    emitComparison(as, false, next);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    emitComparison(as, true, next);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    emitArithmetic(as, 0x58, next);
+    break;
+  case OP_SUBSTRACT:
+  case OP_SUBSTRACT_NUM:
+    emitArithmetic(as, 0x5c, next);
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    emitArithmetic(as, 0x59, next);
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emitArithmetic(as, 0x5e, next);
+    break;
+  case OP_ADD_CONSTANT:
+    emitArithmeticConstant(as, 0x58, code[offset + 1], next,
+                           "Operands must be two numbers or two strings.");
+    break;
+  case OP_SUBSTRACT_CONSTANT:
+    emitArithmeticConstant(as, 0x5c, code[offset + 1], next,
+                           "Operands must be numbers");
+    break;
+  case OP_NOT:
+    emitLoad(as, RAX, RBX, -8);
+    emitMovImm(as, RCX, NIL_VAL);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    emitSet(as, CC_E, RDX);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    emitSet(as, CC_E, RAX);
+    EMIT(as, 0x08, 0xd0);       // or al, dl
+    EMIT(as, 0x0f, 0xb6, 0xc0); // movzx eax, al
+    emitAlu(as, X86_ADD, RAX, RCX);
+    emitStore(as, RBX, -8, RAX);
+    break;
+  case OP_NEGATE: {
+    emitLoad(as, RAX, RBX, -8);
+    int notNumber = emitIfNotNumber(as, RAX);
+    EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63: flip the sign
+    emitStore(as, RBX, -8, RAX);
+    int done = emitJmp(as);
+    patchHere(as, notNumber);
+    emitError(as, next, "Operand must be a number.");
+    patchHere(as, done);
+    break;
+  }
+  case OP_PRINT:
+    emitSync(as, next);
+    emitCallHelper(as, jitPrint);
+    break;
+  case OP_JUMP:
+    jumpTo(as, emitJmp(as), jumpTarget(as->chunk, offset));
+    break;
+  case OP_LOOP:
+    // safepoint: collect the nursery once it is full
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.nurseryFull);
+    EMIT(as, 0x80, 0x38, 0x00); // cmp byte [rax], 0
+    jumpTo(as, emitJcc(as, CC_E), jumpTarget(as->chunk, offset));
+    emitSync(as, next);
+    emitCallHelper(as, jitSafepoint);
+    jumpTo(as, emitJmp(as), jumpTarget(as->chunk, offset));
+    break;
+  case OP_JUMP_IF_FALSE:
+    emitLoad(as, RAX, RBX, -8);
+    emitJumpIfFalsey(as, jumpTarget(as->chunk, offset));
+    break;
+  case OP_POP_JUMP_IF_FALSE:
+    emitMoveStackTop(as, -1);
+    emitLoad(as, RAX, RBX, 0);
+    emitJumpIfFalsey(as, jumpTarget(as->chunk, offset));
+    break;
+  case OP_POP_JUMP_IF_TRUE: {
+    emitMoveStackTop(as, -1);
+    emitLoad(as, RAX, RBX, 0);
+    emitMovImm(as, RCX, NIL_VAL);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    int isNil = emitJcc(as, CC_E);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    int isFalse = emitJcc(as, CC_E);
+    jumpTo(as, emitJmp(as), jumpTarget(as->chunk, offset));
+    patchHere(as, isNil);
+    patchHere(as, isFalse);
+    break;
+  }
+  case OP_JUMP_IF_NOT_LESS:
+    emitCompareJump(as, true, jumpTarget(as->chunk, offset), next);
+    break;
+  case OP_JUMP_IF_NOT_GREATER:
+    emitCompareJump(as, false, jumpTarget(as->chunk, offset), next);
+    break;
+  case OP_CALL:
+    emitSync(as, next);
+    emitIntArgument(as, RDI, code[offset + 1]);
+    emitCallHelper(as, jitCall);
+    break;
+  case OP_INVOKE: {
+    InlineCache *cache =
+        &as->chunk->caches[(code[offset + 3] << 8) | code[offset + 4]];
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitIntArgument(as, RSI, code[offset + 2]);
+    emitMovImm(as, RDX, (uint64_t)(uintptr_t)cache);
+    emitCallHelper(as, jitInvoke);
+    break;
+  }
+  case OP_SUPER_INVOKE:
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitIntArgument(as, RSI, code[offset + 2]);
+    emitCallHelper(as, jitSuperInvoke);
+    break;
+  case OP_TAIL_CALL: {
+    // calling the running closure itself: a loop. The arguments slide
+    // down to the slots, then jump back to the first instruction, unless
+    // a local is captured (its upvalue must be closed first).
+    int argCount = code[offset + 1];
+    emitLoad(as, RAX, RBX, -8 * (argCount + 1));
+    emitLoad(as, RCX, R14, offsetof(CallFrame, closure));
+    emitMovImm(as, RDX, SIGN_BIT | QNAN);
+    emitAlu(as, X86_OR, RCX, RDX);
+    emitAlu(as, X86_CMP, RAX, RCX);
+    int otherCallee = emitJcc(as, CC_NE);
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&vm.openUpvalues);
+    emitLoad(as, RAX, RAX, 0);
+    EMIT(as, 0x48, 0x85, 0xc0); // test rax, rax
+    int noUpvalue = emitJcc(as, CC_E);
+    emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+    emitAlu(as, X86_CMP, RAX, R12);
+    int captured = emitJcc(as, CC_AE);
+    patchHere(as, noUpvalue);
+    for (int i = 1; i <= argCount; i++) {
+      emitLoad(as, RAX, RBX, -8 * (argCount + 1 - i));
+      emitStore(as, R12, 8 * i, RAX);
+    }
+    emitLea(as, RBX, R12, 8 * (argCount + 1));
+    jumpTo(as, emitJmp(as), 0);
+    patchHere(as, otherCallee);
+    patchHere(as, captured);
+  }
+    // fallthrough
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    // the helper replaces the frame with the callee's, which the caller
+    // of the machine code runs: exit as if the frame returned.
+    emitSync(as, next);
+    if (code[offset] == OP_TAIL_CALL) {
+      emitIntArgument(as, RDI, code[offset + 1]);
+      emitCallHelper(as, jitTailCall);
+    } else if (code[offset] == OP_TAIL_INVOKE) {
+      emitConstantArgument(as, RDI, code[offset + 1]);
+      emitIntArgument(as, RSI, code[offset + 2]);
+      emitMovImm(as, RDX,
+                 (uint64_t)(uintptr_t)&as->chunk
+                     ->caches[(code[offset + 3] << 8) | code[offset + 4]]);
+      emitCallHelper(as, jitTailInvoke);
+    } else {
+      emitConstantArgument(as, RDI, code[offset + 1]);
+      emitIntArgument(as, RSI, code[offset + 2]);
+      emitCallHelper(as, jitTailSuperInvoke);
+    }
+    emitIntArgument(as, RAX, INTERPRET_OK);
+    returns[(*returnCount)++] = emitJmp(as);
+    break;
+  case OP_CLOSURE:
+    emitSync(as, next);
+    emitMovImm(as, RDI, (uint64_t)(uintptr_t)&code[offset + 1]);
+    emitCallHelper(as, jitClosure);
+    break;
+  case OP_CLOSE_UPVALUE:
+    emitSync(as, next);
+    emitCallHelper(as, jitCloseUpvalue);
+    break;
+  case OP_RETURN:
+    emitSync(as, next);
+    emitAlu(as, X86_MOV, RDI, R14);
+    emitCallHelper(as, jitReturn);
+    emitIntArgument(as, RAX, INTERPRET_OK);
+    returns[(*returnCount)++] = emitJmp(as);
+    break;
+  case OP_CLASS:
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitCallHelper(as, jitClass);
+    break;
+  case OP_INHERIT:
+    emitSync(as, next);
+    emitCallHelper(as, jitInherit);
+    break;
+  case OP_METHOD:
+    emitSync(as, next);
+    emitConstantArgument(as, RDI, code[offset + 1]);
+    emitCallHelper(as, jitMethod);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Compile `function` to machine code.
+ * Returns false (and the function stays interpreted) if it can't be.
+ */
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  Assembler as;
+  as.chunk = chunk;
+  as.code = NULL;
+  as.count = 0;
+  as.capacity = 0;
+  as.jumps = NULL;
+  as.jumpCount = 0;
+  as.jumpCapacity = 0;
+  as.errorJumps = NULL;
+  as.errorCount = 0;
+  as.errorCapacity = 0;
+
+  int count = chunk->count;
+  uint32_t *offsets = ALLOCATE(uint32_t, count + 1);
+  // jumps to the epilogue, one per `OP_RETURN`
+  int *returns = ALLOCATE(int, count);
+  int returnCount = 0;
+
+  emitPrologue(&as);
+  bool supported = true;
+  for (int offset = 0; offset < count && supported;
+       offset += instructionLength(chunk, offset)) {
+    offsets[offset] = as.count;
+    supported = emitInstruction(&as, offset, returns, &returnCount);
+  }
+  offsets[count] = as.count;
+
+  JitCode *jit = NULL;
+  if (supported) {
+    // runtime errors exit with INTERPRET_RUNTIME_ERROR
+    for (int i = 0; i < as.errorCount; i++) {
+      patchHere(&as, as.errorJumps[i]);
+    }
+    emitIntArgument(&as, RAX, INTERPRET_RUNTIME_ERROR);
+    for (int i = 0; i < returnCount; i++) {
+      patchHere(&as, returns[i]);
+    }
+    emitEpilogue(&as);
+    for (int i = 0; i < as.jumpCount; i++) {
+      int patch = as.jumps[i].patch;
+      patch32(&as, patch,
+              (uint32_t)(offsets[as.jumps[i].target] - (patch + 4)));
+    }
+
+    // W^X: the pages are only made executable once written
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = (as.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+      memcpy(memory, as.code, as.count);
+      if (mprotect(memory, size, PROT_READ | PROT_EXEC) == 0) {
+        jit = ALLOCATE(JitCode, 1);
+        jit->code = memory;
+        jit->size = size;
+        jit->offsets = offsets;
+        jit->count = count + 1;
+        offsets = NULL;
+      } else {
+        munmap(memory, size);
+      }
+    }
+  }
+
+  if (offsets != NULL) {
+    FREE_ARRAY(uint32_t, offsets, count + 1);
+  }
+  FREE_ARRAY(int, returns, count);
+  FREE_ARRAY(uint8_t, as.code, as.capacity);
+  FREE_ARRAY(JitJump, as.jumps, as.jumpCapacity);
+  FREE_ARRAY(int, as.errorJumps, as.errorCapacity);
+  function->jitCode = jit;
+  return jit != NULL;
+}
+
+void freeJitCode(JitCode *jit) {
+  if (jit == NULL)
+    return;
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(uint32_t, jit->offsets, jit->count);
+  FREE(JitCode, jit);
+}
+
+/**
+ * Run the machine code of the function of `frame`, from its current
+ * instruction until the frame returns.
+ */
+InterpretResult jitEnter(CallFrame *frame) {
+  JitCode *jit = frame->closure->function->jitCode;
+  int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+  JitFunction code = (JitFunction)(uintptr_t)jit->code;
+  vm.jitDepth++;
+  InterpretResult result = code((size_t)(frame - vm.frames) * sizeof(CallFrame),
+                                jit->code + jit->offsets[offset]);
+  vm.jitDepth--;
+  // safepoint: the machine code exits on returns and tail calls
+  if (result == INTERPRET_OK && vm.nurseryFull) {
+    collectNursery();
+  }
+  return result;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// number of calls plus loop iterations after which a function is compiled
+// to machine code.
+#define JIT_THRESHOLD 1000
+
+// Calls between machine code frames go through the C stack: past that many
+// nested machine code frames, callees are interpreted (in a flat loop)
+// until the recursion unwinds.
+#define JIT_MAX_DEPTH 1000
+
+// machine code of a function
+typedef struct JitCode {
+  uint8_t *code; // executable memory, mapped with `mmap()`
+  size_t size;   // mapped size
+  // offset in `code` of each instruction, indexed by its offset in the
+  // chunk: any instruction can be the entry point.
+  uint32_t *offsets;
+  int count; // length of `offsets`
+} JitCode;
+
+bool jitCompile(ObjFunction *function);
+void freeJitCode(JitCode *jit);
+InterpretResult jitEnter(CallFrame *frame);
+
+// Runtime helpers called by the machine code, implemented in vm.c.
+// They work on `vm.stackTop`, like the stack VM instructions they stand
+// for, and return false after reporting a runtime error.
+bool jitRuntimeError(const char *message);
+bool jitUndefinedVariable(int slot);
+bool jitAdd(void);
+bool jitEqual(void);
+bool jitPrint(void);
+bool jitCall(int argCount);
+bool jitInvoke(Value name, int argCount, InlineCache *cache);
+bool jitSuperInvoke(Value name, int argCount);
+bool jitTailCall(int argCount);
+bool jitTailInvoke(Value name, int argCount, InlineCache *cache);
+bool jitTailSuperInvoke(Value name, int argCount);
+bool jitGetProperty(Value name, InlineCache *cache);
+bool jitSetProperty(Value name, InlineCache *cache);
+bool jitGetSuper(Value name);
+bool jitClosure(uint8_t *operands);
+bool jitCloseUpvalue(void);
+bool jitReturn(CallFrame *frame);
+bool jitClass(Value name);
+bool jitInherit(void);
+bool jitMethod(Value name);
+bool jitSafepoint(void);
+bool jitSetUpvalue(int index);
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "vm.h"
 
 static void repl(void) {
@@ -58,12 +59,63 @@ static void runFile(const char *path) {
 int main(int argc, char **argv) {
   initVM();
 
-  if (argc == 1) {
+  // backend selection, before the script path
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "--register") == 0) {
+      vm.backend = BACKEND_REGISTER;
+    } else if (strcmp(argv[arg], "--stack") == 0) {
+      vm.backend = BACKEND_STACK;
+    } else if (strcmp(argv[arg], "--no-jit") == 0) {
+      vm.jit = false;
+    } else if (strncmp(argv[arg], "--gc-incremental", 16) == 0 &&
+               (argv[arg][16] == '\0' || argv[arg][16] == '=')) {
+      // `--gc-incremental=<µs>` sets the pause budget of the slices
+      vm.gcSliceBudget =
+          argv[arg][16] == '=' ? atoi(argv[arg] + 17) : GC_SLICE_BUDGET;
+      if (vm.gcSliceBudget <= 0) {
+        vm.gcSliceBudget = GC_SLICE_BUDGET;
+      }
+#ifdef CONCURRENT_GC
+    } else if (strcmp(argv[arg], "--gc-concurrent") == 0) {
+      // marking in the background, sweeping in slices
+      vm.gcConcurrent = true;
+      if (vm.gcSliceBudget == 0) {
+        vm.gcSliceBudget = GC_SLICE_BUDGET;
+      }
+#endif
+#ifdef PARALLEL_GC
+    } else if (strncmp(argv[arg], "--gc-threads=", 13) == 0) {
+      vm.gcThreads = atoi(argv[arg] + 13);
+      if (vm.gcThreads < 1) {
+        vm.gcThreads = 1;
+      } else if (vm.gcThreads > GC_MAX_THREADS) {
+        vm.gcThreads = GC_MAX_THREADS;
+      }
+#endif
+    } else if (strncmp(argv[arg], "--gc-compact", 12) == 0 &&
+               (argv[arg][12] == '\0' || argv[arg][12] == '=')) {
+      // `--gc-compact=<percent>` sets the occupancy under which to compact
+      vm.gcCompact =
+          argv[arg][12] == '=' ? atoi(argv[arg] + 13) : GC_COMPACT_THRESHOLD;
+      if (vm.gcCompact <= 0) {
+        vm.gcCompact = GC_COMPACT_THRESHOLD;
+      }
+    } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+      vm.showGCStats = true; // printed by `freeVM()`
+    } else if (strcmp(argv[arg], "--table-stats") == 0) {
+      vm.showTableStats = true; // printed by `freeVM()`
+    } else {
+      break;
+    }
+  }
+
+  if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (arg == argc - 1) {
+    runFile(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: %s clox [path]\n", argv[0]);
+    fprintf(stderr, "Usage: %s clox [--stack|--register] [--no-jit] [--gc-incremental[=<us>]] [--gc-concurrent] [--gc-threads=<n>] [--gc-compact[=<percent>]] [--gc-stats] [--table-stats] [path]\n", argv[0]);
   }
 
   freeVM();
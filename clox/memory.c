@@ -1,27 +1,185 @@
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif
 
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+#include <pthread.h>
+#endif
+#ifdef PARALLEL_GC
+#include <sched.h>
+#endif
+
+/**
+ * Generational GC.
+ *
+ * New objects are bump allocated in the nursery (the young generation).
+ * Most of them die young: a minor collection (`collectNursery()`) copies
+ * the few reachable ones to the old generation, then empties the whole
+ * nursery at once. Its cost is proportional to the survivors, not to the
+ * garbage.
+ *
+ * Old objects live in pages of `HEAP_PAGE_SIZE` bytes, each one divided
+ * in cells of a single size class. Objects larger than the largest class
+ * (long strings) get a page of their own, as big as needed. A page header
+ * holds two bitmaps, with a bit per CELL_GRANULE: the cells allocated,
+ * and the marked ones. Allocating looks for a clear bit in the first,
+ * sweeping frees the allocated cells left unmarked in the second, then
+ * drops them from the first.
+ *
+ * The meaning of the mark bits flips at each major collection
+ * (`vm.gcEpoch`): the survivors of the previous one are white again,
+ * without a pass clearing their bits. Neither marking nor sweeping write
+ * to the live objects themselves, which keeps their memory clean (and
+ * shared with the processes forked from this one).
+ *
+ * A minor collection only traces from the roots and from the old objects
+ * that may reference young ones: stores of references into old objects
+ * go through `writeBarrier()`, which remembers them in `vm.remembered`.
+ * Global variables are roots, their stores need no barrier.
+ *
+ * Copying moves objects, while the C code holds pointers to them in
+ * locals: minor collections only run at safepoints, where the VM state is
+ * stored and no C code is in the middle of an allocation sequence. When
+ * the nursery fills up, the interpreter collects it at its next backward
+ * jump, return or tail call. Until then (and for objects that don't fit),
+ * objects are allocated in the old generation, and remembered.
+ *
+ * Major collections (`collectGarbage()`) mark and sweep the whole heap,
+ * when the old generation doubles. They don't move objects, so they still
+ * run from any allocation. Young objects are marked, but only freed by
+ * the next minor collection.
+ *
+ * The sweeping is lazy: once the marking is over, the pages move to
+ * `vm.sweepPages`, and the program resumes. Allocating in a size class
+ * without free cells sweeps its pages (`sweepForCell()`) until one has
+ * some, and slices sweep the others every GC_SLICE_BYTES the old
+ * generation grows. Meanwhile, new objects only get the cells of swept
+ * pages, or of new ones. The next marking only starts once every page was
+ * swept: the mark bits of the unswept pages are still needed.
+ *
+ * With `vm.gcSliceBudget` set, major collections are incremental: they
+ * run in slices interleaved with the program, each one marking (or
+ * sweeping) until its time budget is spent, every GC_SLICE_BYTES the old
+ * generation grows. While marking, `writeBarrier()` marks the objects
+ * stored into marked ones. The roots are stored to without barrier: once
+ * the gray objects run out, `finishMarking()` marks them again, and what
+ * they reach, in one last pause.
+ *
+ * With `vm.gcConcurrent` set, a background thread does the marking
+ * (`markerThread()`) while the program runs. It starts right after a
+ * minor collection, from the roots marked in a short pause: the nursery is
+ * empty, and the marker never follows references to young objects (a
+ * minor collection may move them at any time). Everything reachable then
+ * gets marked (snapshot at the beginning): the program marks the
+ * references it overwrites in the heap (`deletionBarrier()`) and hands
+ * them over to the marker, new old objects (allocated or promoted) are
+ * born marked. The blocks the program frees meanwhile are only released
+ * once the marker stopped, it may still be reading them. When the marker
+ * runs out of work, `finishMarking()` ends the marking in one last pause,
+ * then the sweeping runs in slices.
+ *
+ * With `vm.gcCompact` set, a major collection that leaves the pages of
+ * the old generation too sparse asks for a compaction (`compactHeap()`),
+ * run at the next minor collection, since it moves objects. The sparsest
+ * pages of each size class are evacuated into the densest ones, their
+ * objects leaving their new address in `next` as promoted ones do, then
+ * every reference is updated and the emptied pages are released.
+ *
+ * With `vm.gcThreads` over 1, the marking done in a pause (all of it for
+ * a stop-the-world collection, the last step otherwise) is spread over
+ * that many threads (`traceParallel()`). Each one blackens the gray
+ * objects of its own deque, and steals from the others once it runs out.
+ */
+
 #define GC_HEAP_GROW_FACTOR 2
 
+// the slices read the clock every that many objects marked or swept
+#define GC_CLOCK_INTERVAL 64
+
+static void pollMajor(void);
+#ifdef DEBUG_STRESS_GC
+static void stressGarbage(void);
+#endif
+
+// every object in the nursery starts on an 8 bytes boundary
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t)7)
+
+// growable stack of pointers, in system memory like the gray stack
+typedef struct {
+  void **items;
+  int count;
+  int capacity;
+} PointerStack;
+
+static void pushPointer(PointerStack *stack, void *item) {
+  if (stack->capacity < stack->count + 1) {
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+    stack->items =
+        (void **)realloc(stack->items, sizeof(void *) * stack->capacity);
+    if (stack->items == NULL) {
+      exit(1);
+    }
+  }
+  stack->items[stack->count++] = item;
+}
+
+// copies made by a minor collection, whose references are left to promote
+static PointerStack promoted;
+
+#ifdef CONCURRENT_GC
+// objects shaded by the program are handed over to the marker in batches
+#define SHADED_BATCH 256
+
+// the background marking thread. While it runs, it owns `vm.grayStack`.
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  // signaled when `queue` or `stop` change
+  PointerStack queue;   // shaded objects handed over (under `lock`)
+  bool idle;            // waiting for `queue` (set under `lock`)
+  bool stop;            // exit once out of work (under `lock`)
+  PointerStack shaded;  // program side: shaded, not handed over yet
+  PointerStack deferred; // blocks freed by the program while marking
+} marker = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .wake = PTHREAD_COND_INITIALIZER};
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   // keep track of allocated memory
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+    stressGarbage();
 #endif
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
+    pollMajor();
+  }
+
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_CONCURRENT_MARK && pointer != NULL) {
+    // the marker may be reading the old block: move, free it later.
+    void *result = NULL;
+    if (newSize > 0) {
+      result = malloc(newSize);
+      if (result == NULL) {
+        exit(1);
+      }
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
     }
+    pushPointer(&marker.deferred, pointer);
+    return result;
   }
+#endif
 
   if (newSize == 0) {
     free(pointer);
@@ -35,22 +193,358 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-// mark an object, and append it to the vm's gray object stack
-void markObject(Obj *object) {
-  if (object == NULL) {
-    return;
+// pages of the old generation are that big, and aligned on that size
+#define HEAP_PAGE_SIZE (64 * 1024)
+// cell sizes are multiples of this
+#define CELL_GRANULE 16
+// largest cell, bigger objects are allocated in a page of their own
+#define CELL_MAX (8 * 1024)
+#define PAGE_BITMAP_WORDS (HEAP_PAGE_SIZE / CELL_GRANULE / 64)
+
+struct Page {
+  Page *next;     // in `vm.pages` or `vm.sweepPages[sizeClass]`
+  Page *nextFree; // in `vm.freePages[sizeClass]`, while it has free cells
+  int sizeClass;
+  int cellSize;
+  int cellCount;
+  int freeCount;
+  // words of `allocated` before this one have no free cell
+  int freeWord;
+  // its objects are moving out (see `compactHeap()`)
+  bool evacuated;
+  // bit `i` set: an object starts `i` granules after the page start
+  uint64_t allocated[PAGE_BITMAP_WORDS];
+  // bit `i` equal to `vm.gcEpoch`: the object at granule `i` is marked
+  uint64_t marks[PAGE_BITMAP_WORDS];
+};
+
+// offset of the first cell
+#define PAGE_HEADER_SIZE                                                       \
+  ((sizeof(Page) + CELL_GRANULE - 1) & ~(size_t)(CELL_GRANULE - 1))
+
+_Static_assert(sizeof(ObjInstance) + sizeof(Value) * INSTANCE_INLINE_FIELDS_MAX <=
+                   CELL_MAX,
+               "the largest instance must fit a cell");
+
+// size class of the cells for objects of `size` bytes: 16 bytes apart up
+// to 256, then 4 per doubling.
+static inline int sizeClassOf(size_t size) {
+  if (size <= 256) {
+    return (int)((size - 1) / CELL_GRANULE);
   }
-  if (object->isMarked) {
-    return;
+  if (size > CELL_MAX) {
+    return GC_LARGE_CLASS;
   }
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", (void *)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+  // 2^log < size <= 2^(log + 1)
+  int log = 63 - __builtin_clzll(size - 1);
+  size_t quarter = (size_t)1 << (log - 2);
+  return 16 + (log - 8) * 4 + (int)((size - 1 - ((size_t)1 << log)) / quarter);
+}
+
+// size of the cells of class `sizeClass` (see `sizeClassOf()`)
+static inline int cellSizeOf(int sizeClass) {
+  if (sizeClass < 16) {
+    return (sizeClass + 1) * CELL_GRANULE;
+  }
+  int log = 8 + (sizeClass - 16) / 4;
+  return (1 << log) + ((sizeClass - 16) % 4 + 1) * (1 << (log - 2));
+}
+
+static inline Page *pageOf(Obj *object) {
+  return (Page *)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t granuleOf(Obj *object) {
+  return ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / CELL_GRANULE;
+}
+
+static inline Obj *pageCell(Page *page, int index) {
+  return (Obj *)((uint8_t *)page + PAGE_HEADER_SIZE +
+                 (size_t)index * page->cellSize);
+}
+
+static inline bool isAllocated(Page *page, size_t granule) {
+  return page->allocated[granule / 64] >> (granule % 64) & 1;
+}
+
+// for each size class, the granules where its cells start
+static uint64_t cellStarts[GC_SIZE_CLASSES][PAGE_BITMAP_WORDS];
+
+// a page of free cells for objects of class `sizeClass`
+static Page *newPage(int sizeClass) {
+  Page *page = (Page *)aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+  if (page == NULL) {
+    exit(1);
+  }
+  page->sizeClass = sizeClass;
+  page->cellSize = cellSizeOf(sizeClass);
+  page->cellCount = (HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / page->cellSize;
+  page->freeCount = page->cellCount;
+  page->freeWord = 0;
+  page->evacuated = false;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marks, 0, sizeof(page->marks));
+  uint64_t *starts = cellStarts[sizeClass];
+  if (starts[PAGE_HEADER_SIZE / CELL_GRANULE / 64] == 0) {
+    for (int i = 0; i < page->cellCount; i++) {
+      size_t granule = granuleOf(pageCell(page, i));
+      starts[granule / 64] |= (uint64_t)1 << (granule % 64);
+    }
+  }
+  page->next = vm.pages;
+  vm.pages = page;
+  page->nextFree = vm.freePages[sizeClass];
+  vm.freePages[sizeClass] = page;
+  return page;
+}
+
+// a page holding a single object of `size` bytes, over CELL_MAX
+static Obj *allocateLarge(size_t size) {
+  Page *page;
+  if (posix_memalign((void **)&page, HEAP_PAGE_SIZE,
+                     PAGE_HEADER_SIZE + size) != 0) {
+    exit(1);
+  }
+  page->sizeClass = GC_LARGE_CLASS;
+  page->cellSize = (int)size;
+  page->cellCount = 1;
+  page->freeCount = 0;
+  page->freeWord = 0;
+  page->evacuated = false;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->marks, 0, sizeof(page->marks));
+  Obj *object = pageCell(page, 0);
+  size_t granule = granuleOf(object);
+  page->allocated[granule / 64] |= (uint64_t)1 << (granule % 64);
+  page->next = vm.pages;
+  vm.pages = page;
+  return object;
+}
+
+static Page *sweepForCell(int sizeClass);
+
+// a cell for an old object of `size` bytes. Never collects.
+static Obj *allocateCell(size_t size) {
+  int sizeClass = sizeClassOf(size);
+  if (sizeClass == GC_LARGE_CLASS) {
+    return allocateLarge(size);
+  }
+  Page *page = vm.freePages[sizeClass];
+  if (page == NULL && vm.sweepPages[sizeClass] != NULL) {
+    page = sweepForCell(sizeClass);
+  }
+  if (page == NULL) {
+    page = newPage(sizeClass);
+  }
+  // the first free cell, from `freeWord` on
+  uint64_t *starts = cellStarts[sizeClass];
+  int word = page->freeWord;
+  uint64_t free = starts[word] & ~page->allocated[word];
+  while (free == 0) {
+    word++;
+    free = starts[word] & ~page->allocated[word];
+  }
+  page->freeWord = word;
+  page->allocated[word] |= free & -free;
+  if (--page->freeCount == 0) {
+    vm.freePages[sizeClass] = page->nextFree;
+  }
+  size_t granule = (size_t)word * 64 + __builtin_ctzll(free);
+  return (Obj *)((uint8_t *)page + granule * CELL_GRANULE);
+}
+
+// mark bits of the young objects, one per 8 bytes of nursery, set when
+// marked. The nursery is empty, or the marking over, when they are
+// cleared.
+static uint64_t nurseryMarks[(NURSERY_SIZE / 8 + 63) / 64];
+
+/**
+ * The word holding the mark bit of `object`, with the bit in `bit`, and
+ * the value it has when the object is marked in `marked`.
+ */
+static inline uint64_t *markWord(Obj *object, uint64_t *bit,
+                                 uint64_t *marked) {
+  if (isYoung(object)) {
+    size_t index = ((uint8_t *)object - vm.nursery) / 8;
+    *bit = (uint64_t)1 << (index % 64);
+    *marked = *bit;
+    return &nurseryMarks[index / 64];
+  }
+  size_t granule = granuleOf(object);
+  *bit = (uint64_t)1 << (granule % 64);
+  *marked = vm.gcEpoch ? *bit : 0;
+  return &pageOf(object)->marks[granule / 64];
+}
+
+bool isMarked(Obj *object) {
+  uint64_t bit, marked;
+  uint64_t *word = markWord(object, &bit, &marked);
+  return (*word & bit) == marked;
+}
+
+// set the mark of an old object to `marked`, when no other thread marks
+static inline void setMarked(Obj *object, bool marked) {
+  uint64_t bit, value;
+  uint64_t *word = markWord(object, &bit, &value);
+  *word = (*word & ~bit) | (marked ? value : value ^ bit);
+}
+
+// mark `object`, when other threads may mark it too: return whether it
+// was unmarked.
+static inline bool markAtomically(Obj *object) {
+  uint64_t bit, marked;
+  uint64_t *word = markWord(object, &bit, &marked);
+  if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) == marked) {
+    return false;
+  }
+  if (marked) {
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+  }
+  return __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit;
+}
+
+/**
+ * Memory for a new object of `size` bytes (header initialized, not its
+ * type). Bump allocated in the nursery; once it is full, requests a
+ * minor collection and allocates in the old generation until it runs.
+ */
+Obj *heapAllocate(size_t size) {
+#ifdef DEBUG_STRESS_GC
+  stressGarbage();
+  vm.nurseryFull = true;
 #endif
+  Obj *object;
+  size_t aligned = ALIGN_OBJECT(size);
+  if ((size_t)(vm.nurseryEnd - vm.nurseryTop) >= aligned) {
+    object = (Obj *)vm.nurseryTop;
+    vm.nurseryTop += aligned;
+    object->isRemembered = false;
+    object->next = NULL;
+    return object;
+  }
+
+  vm.nurseryFull = true;
+  vm.bytesAllocated += size;
+  pollMajor();
+  object = allocateCell(size);
+  if (vm.gcPhase == GC_CONCURRENT_MARK) {
+    // allocated black: the background marker doesn't trace new objects
+    markAtomically(object);
+  } else {
+    // white for the next (or running) marking
+    setMarked(object, vm.gcPhase != GC_MARK);
+  }
+  object->isRemembered = false;
+  object->next = NULL;
+  // its fields are about to be initialized without barrier
+  rememberObject(object);
+  return object;
+}
+
+#ifdef PARALLEL_GC
+/**
+ * Work-stealing deque of gray objects (Chase and Lev, with the C11
+ * orderings of Le et al.): its owner pushes and takes at the bottom, the
+ * other marking threads steal from the top.
+ */
+typedef struct {
+  int64_t size; // power of 2
+  Obj *items[];
+} DequeArray;
+
+// a marking thread of `traceParallel()`
+typedef struct {
+  int64_t top;
+  int64_t bottom;
+  DequeArray *array;
+  PointerStack retired; // outgrown arrays, thieves may still read them
+  pthread_t thread;
+  unsigned int seed; // to pick the first victim to steal from
+} __attribute__((aligned(64))) Worker;
+
+#define DEQUE_INITIAL_SIZE 1024
+
+static Worker workers[GC_MAX_THREADS];
+static int workerCount;
+static int idleWorkers;
+// the worker run by this thread, NULL out of `traceParallel()`
+static _Thread_local Worker *worker;
+
+static DequeArray *newDequeArray(int64_t size) {
+  DequeArray *array =
+      (DequeArray *)malloc(sizeof(DequeArray) + sizeof(Obj *) * size);
+  if (array == NULL) {
+    exit(1);
+  }
+  array->size = size;
+  return array;
+}
+
+// owner only
+static void dequePush(Worker *deque, Obj *object) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  DequeArray *array = deque->array;
+  if (bottom - top > array->size - 1) {
+    DequeArray *grown = newDequeArray(array->size * 2);
+    for (int64_t i = top; i < bottom; i++) {
+      grown->items[i & (grown->size - 1)] = array->items[i & (array->size - 1)];
+    }
+    pushPointer(&deque->retired, array);
+    __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+    array = grown;
+  }
+  __atomic_store_n(&array->items[bottom & (array->size - 1)], object,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// owner only, NULL once empty
+static Obj *dequeTake(Worker *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  DequeArray *array = deque->array;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  Obj *object = __atomic_load_n(&array->items[bottom & (array->size - 1)],
+                                __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // the last one: thieves may be taking it too
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      object = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return object;
+}
 
-  object->isMarked = true;
+// any thread, NULL if empty or if another thread took it first
+static Obj *dequeSteal(Worker *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+  DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  Obj *object = __atomic_load_n(&array->items[top & (array->size - 1)],
+                                __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return object;
+}
+#endif
 
+// append an object to the vm's gray object stack
+static void pushGray(Obj *object) {
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     // reallocate using system realloc, to avoid trigerring
@@ -66,6 +560,43 @@ void markObject(Obj *object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
+// mark an object, and append it to the vm's gray object stack
+void markObject(Obj *object) {
+  if (object == NULL) {
+    return;
+  }
+#ifdef PARALLEL_GC
+  if (worker != NULL) {
+    if (markAtomically(object)) {
+      dequePush(worker, object);
+    }
+    return;
+  }
+#endif
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_CONCURRENT_MARK) {
+    // the background marker: the program may be shading the same objects
+    if (!isYoung(object) && markAtomically(object)) {
+      pushGray(object);
+    }
+    return;
+  }
+#endif
+  uint64_t bit, marked;
+  uint64_t *word = markWord(object, &bit, &marked);
+  if ((*word & bit) == marked) {
+    return;
+  }
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  *word ^= bit;
+  pushGray(object);
+}
+
 void markValue(Value value) {
   if (IS_OBJ(value))
     markObject(AS_OBJ(value));
@@ -77,6 +608,19 @@ void markArray(ValueArray *array) {
   }
 }
 
+// inline caches hold strong references: a shape (or a closure) can't be
+// freed then re-allocated at the same address while a cache remembers it.
+static void markInlineCaches(Chunk *chunk) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    for (int way = 0; way < INLINE_CACHE_WAYS; way++) {
+      markObject((Obj *)cache->ways[way].shape);
+      markObject((Obj *)cache->ways[way].transition);
+      markObject((Obj *)cache->ways[way].method);
+    }
+  }
+}
+
 /**
  * Append the children of the object
  * to the "grayStack", unless they are "marked" (done in markObject)
@@ -98,11 +642,12 @@ static void blackenObject(Obj *object) {
     markObject((Obj *)bound->method);
     break;
   }
-  // mark class name + methods
+  // mark class name + methods + root of its shapes tree
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
     markObject((Obj *)klass->name);
     markTable(&klass->methods);
+    markObject((Obj *)klass->rootShape);
     break;
   }
   // mark function and the upvalues
@@ -114,18 +659,43 @@ static void blackenObject(Obj *object) {
     }
     break;
   }
-  // mark the name and the constant table of the function
+  // mark the name, the constant table of the function,
+  // and what its inline caches remember.
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     markObject((Obj *)function->name);
     markArray(&function->chunk.constants);
+    markInlineCaches(&function->chunk);
     break;
   }
-  // mark klass and fields
+  // mark shape (which marks the class) and fields values.
+  // The shape is read first: the fields it names are stored before it
+  // (see `instanceSetField()`), when marking concurrently.
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
-    markObject((Obj *)instance->klass);
-    markTable(&instance->fields);
+    ObjShape *shape = __atomic_load_n(&instance->shape, __ATOMIC_ACQUIRE);
+    Value *fields = __atomic_load_n(&instance->fields, __ATOMIC_ACQUIRE);
+    markObject((Obj *)shape);
+    for (int i = 0; i < shape->fieldCount; i++) {
+      markValue(fields[i]);
+    }
+    break;
+  }
+  // mark the whole shape tree: parents, children and field names
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markObject((Obj *)shape->klass);
+    markObject((Obj *)shape->parent);
+    markObject((Obj *)shape->name);
+    markTable(&shape->transitions);
+    break;
+  }
+  // its pieces, or what it was flattened to
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    markObject(rope->left);
+    markObject(rope->right);
+    markObject((Obj *)rope->flat);
     break;
   }
   // simply mark the value
@@ -140,70 +710,131 @@ static void blackenObject(Obj *object) {
   }
 }
 
-void freeObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d\n", (void *)object, object->type);
-#endif
+// size of the object itself, not counting the memory it owns
+static size_t objectSize(Obj *object) {
   switch (object->type) {
-  case OBJ_BOUND_METHOD: {
-    FREE(ObjBoundMethod, object);
+  case OBJ_BOUND_METHOD:
+    return sizeof(ObjBoundMethod);
+  case OBJ_CLASS:
+    return sizeof(ObjClass);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_INSTANCE:
+    return sizeof(ObjInstance) +
+           sizeof(Value) * ((ObjInstance *)object)->inlineCapacity;
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_ROPE:
+    return sizeof(ObjRope);
+  case OBJ_SHAPE:
+    return sizeof(ObjShape);
+  case OBJ_STRING:
+    return STRING_SIZE(((ObjString *)object)->length);
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0; // unreachable
+}
+
+// free the memory owned by an object, but not the object itself
+static void freeObjectContents(Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD:
     // does not _own_ the method nor the object bound to it.
     break;
-  }
   case OBJ_CLASS: {
     // We rely on garbage collection to free `class->name`
     ObjClass *klass = (ObjClass *)object;
     freeTable(&klass->methods);
-    FREE(ObjClass, object);
     break;
   }
   case OBJ_CLOSURE: {
     // closure does not own its function
     ObjClosure *closure = (ObjClosure *)object;
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
     break;
   }
-  case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+  case OBJ_UPVALUE:
     break;
-  }
   case OBJ_FUNCTION: {
     // downcast Obj -> ObjFunction
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+#ifdef JIT
+    freeJitCode(function->jitCode);
+#endif
     // We rely on garbage collection to free `function->name`
     break;
   }
   case OBJ_INSTANCE: {
-    // We rely on garbage collection to free `instance->klass`
+    // We rely on garbage collection to free `instance->shape`
     ObjInstance *instance = (ObjInstance *)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
     break;
   }
-  case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    freeTable(&shape->transitions);
     break;
   }
-  case OBJ_STRING: {
-    // downcast Obj -> ObjString
-    ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+  case OBJ_NATIVE:
+  case OBJ_ROPE:
+    break;
+  case OBJ_STRING:
+    // its chars are stored inline
     break;
   }
+}
+
+// free an old object, its cell is left to the caller
+static void freeObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)object, object->type);
+#endif
+  vm.bytesAllocated -= objectSize(object);
+  freeObjectContents(object);
+}
+
+/**
+ * The slots above the top are dead, but the register backend doesn't
+ * clear the registers of a new frame: they must not keep references to
+ * the objects freed (or moved) by this cycle. Only the slots written since
+ * the last one can: those below the high-water mark, or in the registers
+ * of a frame (during a call, they are above the top). The stack backend
+ * never reads them.
+ */
+static void clearDeadStack(void) {
+  if (vm.backend != BACKEND_REGISTER) {
+    return;
+  }
+  int end = vm.stackHighWater;
+  for (int i = 0; i < vm.frameCount; i++) {
+    CallFrame *frame = &vm.frames[i];
+    int frameEnd = (int)(frame->slots - vm.stack) +
+                   frame->closure->function->chunk.registers.registerCount;
+    if (frameEnd > end) {
+      end = frameEnd;
+    }
+  }
+  for (Value *slot = vm.stackTop; slot < vm.stack + end; slot++) {
+    *slot = NIL_VAL;
   }
+  vm.stackHighWater = (int)(vm.stackTop - vm.stack);
 }
 
 // mark traversed objects, starting from the roots
 // (part of GC mark phase)
 static void markRoots(void) {
   // check vm value stack
+  // (run() stores its cached stack top before anything that allocates)
   for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
     markValue(*slot);
   }
+  clearDeadStack();
 
   // check closures
   for (int i = 0; i < vm.frameCount; i++) {
@@ -217,7 +848,9 @@ static void markRoots(void) {
   }
 
   // check globals
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
 
   // mark objects allacated by the compiler
   markCompilerRoots();
@@ -226,59 +859,443 @@ static void markRoots(void) {
   markObject((Obj *)vm.initString);
 }
 
-static void traceReferences(void) {
+// seconds elapsed since an arbitrary point, to time the pauses
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+// blacken the gray objects until there are none left (return true), or
+// until `deadline` (return false).
+static bool traceReferences(double deadline) {
+  int work = 0;
   // process the "grayStack", as a process queue
   while (vm.grayCount > 0) {
+    if (++work % GC_CLOCK_INTERVAL == 0 && now() > deadline) {
+      return false;
+    }
     Obj *object = vm.grayStack[--vm.grayCount];
     // might grow the grayStack
     blackenObject(object);
   }
+  return true;
+}
+
+#ifdef PARALLEL_GC
+// steal a gray object from another worker, starting from a random one
+static Obj *stealGray(void) {
+  int first = rand_r(&worker->seed) % workerCount;
+  for (int i = 0; i < workerCount; i++) {
+    Worker *victim = &workers[(first + i) % workerCount];
+    if (victim == worker) {
+      continue;
+    }
+    Obj *object = dequeSteal(victim);
+    if (object != NULL) {
+      return object;
+    }
+  }
+  return NULL;
 }
 
-static void sweep(void) {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
+static bool anyGray(void) {
+  for (int i = 0; i < workerCount; i++) {
+    if (__atomic_load_n(&workers[i].top, __ATOMIC_ACQUIRE) <
+        __atomic_load_n(&workers[i].bottom, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  while (object != NULL) {
-    if (object->isMarked) {
-      // clear marked flag for next GC cycle
-      object->isMarked = false;
-      // go to next obj
-      previous = object;
-      object = object->next;
-    } else {
-      // update head or link to previous
-      Obj *unreached = object;
-      object = object->next;
+/**
+ * Marking thread: blacken the gray objects of its deque, then steal. The
+ * marking is done once every worker is idle: only a working one pushes
+ * gray objects, to its own deque, which it empties before going idle.
+ */
+static void *markWorker(void *arg) {
+  worker = (Worker *)arg;
+  for (;;) {
+    Obj *object;
+    while ((object = dequeTake(worker)) != NULL) {
+      blackenObject(object);
+    }
+    object = stealGray();
+    if (object != NULL) {
+      blackenObject(object);
+      continue;
+    }
 
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
+    __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while (!anyGray()) {
+      if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) == workerCount) {
+        worker = NULL;
+        return NULL;
       }
+      sched_yield();
+    }
+    __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+  }
+}
 
-      freeObject(unreached);
+// blacken every gray object with `vm.gcThreads` threads: the gray stack
+// is dealt to their deques, the calling thread is the first one.
+static void traceParallel(void) {
+  workerCount = vm.gcThreads;
+  idleWorkers = 0;
+  for (int i = 0; i < workerCount; i++) {
+    Worker *deque = &workers[i];
+    if (deque->array == NULL) {
+      deque->array = newDequeArray(DEQUE_INITIAL_SIZE);
     }
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->seed = (unsigned int)i + 1;
+  }
+  for (int i = 0; i < vm.grayCount; i++) {
+    dequePush(&workers[i % workerCount], vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+
+  for (int i = 1; i < workerCount; i++) {
+    if (pthread_create(&workers[i].thread, NULL, markWorker, &workers[i]) !=
+        0) {
+      exit(1);
+    }
+  }
+  markWorker(&workers[0]);
+  for (int i = 1; i < workerCount; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < workerCount; i++) {
+    PointerStack *retired = &workers[i].retired;
+    for (int j = 0; j < retired->count; j++) {
+      free(retired->items[j]);
+    }
+    retired->count = 0;
   }
 }
+#endif
 
-void collectGarbage(void) {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
+// blacken all the gray objects, in a pause
+static void traceAll(void) {
+  double start = now();
+#ifdef PARALLEL_GC
+  if (vm.gcThreads > 1) {
+    traceParallel();
+  } else {
+    traceReferences(INFINITY);
+  }
+#else
+  traceReferences(INFINITY);
 #endif
+  vm.gcStats.traceTime += now() - start;
+}
+
+// drop the remembered objects about to be freed
+static void sweepRemembered(void) {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    if (isMarked(vm.remembered[i])) {
+      vm.remembered[count++] = vm.remembered[i];
+    }
+  }
+  vm.rememberedCount = count;
+}
+
+// free the unmarked objects of `page`. Returns the number of objects left.
+static int sweepPage(Page *page) {
+  int live = 0;
+  for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+    uint64_t marked = vm.gcEpoch ? page->marks[word] : ~page->marks[word];
+    uint64_t dead = page->allocated[word] & ~marked;
+    if (dead != 0) {
+      page->allocated[word] &= marked;
+      if (word < page->freeWord) {
+        page->freeWord = word;
+      }
+      do {
+        size_t granule = (size_t)word * 64 + __builtin_ctzll(dead);
+        freeObject((Obj *)((uint8_t *)page + granule * CELL_GRANULE));
+        dead &= dead - 1;
+      } while (dead != 0);
+    }
+    live += __builtin_popcountll(page->allocated[word]);
+  }
+  page->freeCount = page->cellCount - live;
+  return live;
+}
+
+// move a swept page back to `vm.pages`, and to `vm.freePages` if it has
+// free cells.
+static void keepPage(Page *page) {
+  page->next = vm.pages;
+  vm.pages = page;
+  if (page->freeCount > 0) {
+    page->nextFree = vm.freePages[page->sizeClass];
+    vm.freePages[page->sizeClass] = page;
+  }
+}
+
+/**
+ * Lazy sweeping: sweep the pages of class `sizeClass` left to sweep, until
+ * one has free cells. Returns it, or NULL if none has. Empty pages are
+ * kept, the allocation is about to use them.
+ */
+static Page *sweepForCell(int sizeClass) {
+  double start = now();
+  Page *page = NULL;
+  while (page == NULL && vm.sweepPages[sizeClass] != NULL) {
+    Page *swept = vm.sweepPages[sizeClass];
+    vm.sweepPages[sizeClass] = swept->next;
+    sweepPage(swept);
+    keepPage(swept);
+    if (swept->freeCount > 0) {
+      page = swept;
+    }
+  }
+  vm.gcStats.lazySweepTime += now() - start;
+  return page;
+}
+
+// sweep the pages of `vm.sweepPages`, moving them back to `vm.pages` (or
+// releasing the empty ones), until there is none left (return true) or
+// until `deadline` (return false).
+static bool sweep(double deadline) {
+  for (int sizeClass = 0; sizeClass < GC_SIZE_CLASSES; sizeClass++) {
+    while (vm.sweepPages[sizeClass] != NULL) {
+      if (now() > deadline) {
+        return false;
+      }
+      Page *page = vm.sweepPages[sizeClass];
+      vm.sweepPages[sizeClass] = page->next;
+      if (sweepPage(page) == 0) {
+        free(page);
+      } else {
+        keepPage(page);
+      }
+    }
+  }
+  return true;
+}
+
+static void startMarking(void) {
+  // what the last collection marked is white again
+  vm.gcEpoch ^= 1;
+  markRoots();
+  vm.gcPhase = GC_MARK;
+}
+
+/**
+ * Last (atomic) step of the marking: mark the roots again, then what they
+ * reach. The unmarked objects are garbage: they leave the weak tables,
+ * and the old ones are left to `sweep()`.
+ */
+static void finishMarking(void) {
   markRoots();
-  traceReferences();
+  traceAll();
   // strings are interned in a HashMap, as KEYS.
-  // The global vm.strings hashmap stores all allocated string pointers
+  // The global vm.strings hashmap stores the interned string pointers
   // in a table `Entry` (key + value, here `pointer to string` + NIL).
   // When we de-allocate a key, we must also remove the entry from
   // the table. Otherwise the key would contain a dangling pointer to
   // a non-existing string.
   tableRemoveWhite(&vm.strings);
-  sweep();
+  sweepRemembered();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  // young objects can't be freed one by one: the unmarked ones are left
+  // for the next minor collection.
+  memset(nurseryMarks, 0, sizeof(nurseryMarks));
+
+  // the free cells of the pages to sweep are found again by `sweepPage()`
+  while (vm.pages != NULL) {
+    Page *page = vm.pages;
+    vm.pages = page->next;
+    page->next = vm.sweepPages[page->sizeClass];
+    vm.sweepPages[page->sizeClass] = page;
+  }
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    vm.freePages[i] = NULL;
+  }
+  vm.gcPhase = GC_SWEEP;
+}
+
+// percentage of the cells of the old generation in use, once swept
+static int heapOccupancy(void) {
+  size_t used = 0;
+  size_t total = 0;
+  for (Page *page = vm.pages; page != NULL; page = page->next) {
+    used += (size_t)(page->cellCount - page->freeCount) * page->cellSize;
+    total += (size_t)page->cellCount * page->cellSize;
+  }
+  return total == 0 ? 100 : (int)(used * 100 / total);
+}
+
+static void finishCycle(void) {
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.gcPhase = GC_IDLE;
+  vm.gcStats.majorCount++;
+  // objects only move at safepoints: compact at the next minor collection
+  if (vm.gcCompact > 0 && heapOccupancy() < vm.gcCompact) {
+    vm.gcCompactPending = true;
+    vm.nurseryFull = true;
+  }
+}
+
+// count a pause in the histogram of `printGCStats()`
+static void recordPause(double pause) {
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 &&
+         pause >= (double)(1 << bucket) * 1e-6) {
+    bucket++;
+  }
+  vm.gcStats.pauseHistogram[bucket]++;
+}
+
+static void recordMajorPause(double pause) {
+  vm.gcStats.majorTime += pause;
+  if (pause > vm.gcStats.majorMaxPause) {
+    vm.gcStats.majorMaxPause = pause;
+  }
+  recordPause(pause);
+}
+
+#ifdef CONCURRENT_GC
+/**
+ * Background marking thread: blacken the gray objects, then wait for the
+ * program to hand more over, until it asks to stop.
+ */
+static void *markerThread(void *unused) {
+  (void)unused;
+  for (;;) {
+    double start = now();
+    traceReferences(INFINITY);
+    vm.gcStats.markerTime += now() - start;
+
+    pthread_mutex_lock(&marker.lock);
+    while (marker.queue.count == 0 && !marker.stop) {
+      __atomic_store_n(&marker.idle, true, __ATOMIC_RELEASE);
+      pthread_cond_wait(&marker.wake, &marker.lock);
+    }
+    if (marker.queue.count == 0) {
+      pthread_mutex_unlock(&marker.lock);
+      return NULL;
+    }
+    while (marker.queue.count > 0) {
+      pushGray(marker.queue.items[--marker.queue.count]);
+    }
+    pthread_mutex_unlock(&marker.lock);
+  }
+}
+
+// hand the objects shaded by the program over to the marker
+static void flushShaded(void) {
+  pthread_mutex_lock(&marker.lock);
+  for (int i = 0; i < marker.shaded.count; i++) {
+    pushPointer(&marker.queue, marker.shaded.items[i]);
+  }
+  marker.shaded.count = 0;
+  marker.idle = false;
+  pthread_cond_signal(&marker.wake);
+  pthread_mutex_unlock(&marker.lock);
+}
+
+/**
+ * Program side of the concurrent marking (see `deletionBarrier()`): mark
+ * an old object, and queue it for the marker to trace.
+ */
+void shadeObject(Obj *object) {
+  if (object == NULL || isYoung(object) || !markAtomically(object)) {
+    return;
+  }
+  pushPointer(&marker.shaded, object);
+  if (marker.shaded.count >= SHADED_BATCH) {
+    flushShaded();
+  }
+}
+
+// only right after a minor collection: the nursery must be empty.
+static void startConcurrentMarking(void) {
+  double start = now();
+  vm.gcEpoch ^= 1;
+  markRoots();
+  vm.gcPhase = GC_CONCURRENT_MARK;
+  marker.idle = false;
+  marker.stop = false;
+  if (pthread_create(&marker.thread, NULL, markerThread, NULL) != 0) {
+    exit(1);
+  }
+  recordMajorPause(now() - start);
+}
+
+/**
+ * Wait for the marker to run out of work and exit, then take the marking
+ * back: what is left is traced by `finishMarking()`.
+ */
+static void joinMarker(void) {
+  pthread_mutex_lock(&marker.lock);
+  marker.stop = true;
+  pthread_cond_signal(&marker.wake);
+  pthread_mutex_unlock(&marker.lock);
+  pthread_join(marker.thread, NULL);
+
+  for (int i = 0; i < marker.shaded.count; i++) {
+    pushGray(marker.shaded.items[i]);
+  }
+  marker.shaded.count = 0;
+  for (int i = 0; i < marker.deferred.count; i++) {
+    free(marker.deferred.items[i]);
+  }
+  marker.deferred.count = 0;
+  vm.gcPhase = GC_MARK;
+}
+
+// once the marker waits for work and none is left, end the marking
+static void pollMarker(void) {
+  if (!__atomic_load_n(&marker.idle, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  if (marker.shaded.count > 0) {
+    flushShaded();
+    return;
+  }
+  double start = now();
+  joinMarker();
+  finishMarking();
+  vm.gcNextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+  recordMajorPause(now() - start);
+}
+#endif
+
+/**
+ * Finish the running major collection in one pause, or run the marking of
+ * a new one (its sweeping is lazy).
+ */
+void collectGarbage(void) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+  double start = now();
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_CONCURRENT_MARK) {
+    joinMarker();
+  }
+#endif
+  if (vm.gcPhase == GC_SWEEP) {
+    sweep(INFINITY);
+    finishCycle();
+  } else {
+    if (vm.gcPhase == GC_IDLE) {
+      startMarking();
+    }
+    traceAll();
+    finishMarking();
+    vm.gcNextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+  }
+  recordMajorPause(now() - start);
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
@@ -286,12 +1303,652 @@ void collectGarbage(void) {
 #endif
 }
 
+/**
+ * One pause of an incremental major collection: start one, or move the
+ * running one forward, within `vm.gcSliceBudget`. Only the last step of
+ * the marking (`finishMarking()`) can overrun it.
+ */
+static void collectSlice(void) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc slice, phase %d\n", vm.gcPhase);
+#endif
+  double start = now();
+  // stop-the-world collections only get slices to sweep
+  int budget = vm.gcSliceBudget > 0 ? vm.gcSliceBudget : GC_SLICE_BUDGET;
+  double deadline = start + budget * 1e-6;
+  if (vm.gcPhase == GC_IDLE) {
+    startMarking();
+  }
+  if (vm.gcPhase == GC_MARK) {
+    if (traceReferences(deadline)) {
+      finishMarking();
+    }
+  } else if (sweep(deadline)) {
+    finishCycle();
+  }
+  vm.gcNextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+  vm.gcStats.sliceCount++;
+  recordMajorPause(now() - start);
+}
+
+/**
+ * Called as the old generation grows: run a major collection once it
+ * doubled since the last one. Or the next slice of an incremental one,
+ * which completes at once if the program outruns it. A concurrent one
+ * starts at the next minor collection (see `collectNursery()`).
+ */
+static void pollMajor(void) {
+  if (vm.gcPhase == GC_IDLE) {
+    if (vm.bytesAllocated <= vm.nextGC) {
+      return;
+    }
+    if (vm.gcConcurrent) {
+      vm.nurseryFull = true;
+    } else if (vm.gcSliceBudget == 0) {
+      collectGarbage();
+    } else {
+      collectSlice();
+    }
+  } else if (vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR) {
+    collectGarbage();
+#ifdef CONCURRENT_GC
+  } else if (vm.gcPhase == GC_CONCURRENT_MARK) {
+    pollMarker();
+#endif
+  } else if (vm.bytesAllocated > vm.gcNextSlice) {
+    collectSlice();
+  }
+}
+
+#ifdef DEBUG_STRESS_GC
+// collect as often as possible: a whole major collection, or a slice.
+// A concurrent one starts at every minor collection.
+static void stressGarbage(void) {
+  if (vm.gcConcurrent) {
+    if (vm.gcPhase == GC_IDLE) {
+      vm.nextGC = vm.bytesAllocated;
+    }
+  } else if (vm.gcSliceBudget == 0) {
+    collectGarbage();
+  } else {
+    collectSlice();
+  }
+}
+#endif
+
+void rememberObject(Obj *object) {
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    // system realloc, like the gray stack: barriers run in the middle of
+    // stores, they must not trigger the GC.
+    vm.remembered =
+        (Obj **)realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+    if (vm.remembered == NULL) {
+      exit(1);
+    }
+  }
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+/**
+ * Copy `object` to `copy` (a cell of the old generation), then fix the
+ * pointers the copy has to the object itself.
+ */
+static void moveObject(Obj *object, Obj *copy, size_t size) {
+  memcpy(copy, object, size);
+  if (object->type == OBJ_INSTANCE) {
+    ObjInstance *instance = (ObjInstance *)copy;
+    if (instance->fields == ((ObjInstance *)object)->inlineFields) {
+      instance->fields = instance->inlineFields;
+    }
+  } else if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)copy;
+    if (upvalue->location == &((ObjUpvalue *)object)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+}
+
+/**
+ * Minor collection: the reference in `*slot`, to a young object, is
+ * updated to point to its copy in the old generation. The object is copied
+ * the first time, its copy queued in `promoted` to promote what it
+ * references in turn. The original (in the nursery) keeps the address of
+ * its copy in `next`.
+ */
+static void promoteObject(Obj **slot) {
+  Obj *object = *slot;
+  if (object == NULL || !isYoung(object)) {
+    return;
+  }
+  if (object->next == NULL) {
+    size_t size = objectSize(object);
+    Obj *copy = allocateCell(size);
+    moveObject(object, copy, size);
+    // keeps the mark: it is the same object for an incremental marking,
+    // and a new one (allocated black) for a concurrent one.
+    if (vm.gcPhase == GC_CONCURRENT_MARK) {
+      markAtomically(copy);
+    } else {
+      setMarked(copy, vm.gcPhase != GC_MARK || isMarked(object));
+    }
+    copy->isRemembered = false;
+    copy->next = NULL;
+    vm.bytesAllocated += size;
+    vm.gcStats.promotedBytes += size;
+
+    object->next = copy;
+    pushPointer(&promoted, copy);
+  }
+  *slot = object->next;
+}
+
+/**
+ * Compaction: the reference in `*slot`, to an object of an evacuated page,
+ * is updated to point to its copy (in `next`, like a promoted object).
+ */
+static void forwardObject(Obj **slot) {
+  Obj *object = *slot;
+  if (object != NULL && pageOf(object)->evacuated) {
+    *slot = object->next;
+  }
+}
+
+// what a minor collection (`promoteObject()`) or a compaction
+// (`forwardObject()`) does to each reference that may have to move.
+typedef void (*Relocate)(Obj **slot);
+
+// the value is only written back if its object moved
+static void relocateValue(Value *slot, Relocate relocate) {
+  if (IS_OBJ(*slot)) {
+    Obj *object = AS_OBJ(*slot);
+    relocate(&object);
+    if (object != AS_OBJ(*slot)) {
+      *slot = OBJ_VAL(object);
+    }
+  }
+}
+
+static void relocateArray(ValueArray *array, Relocate relocate) {
+  for (int i = 0; i < array->count; i++) {
+    relocateValue(&array->values[i], relocate);
+  }
+}
+
+// keys keep their hash when they move: entries stay where they are.
+static void relocateTable(Table *table, Relocate relocate) {
+  for (int i = 0; i < table->entryCount; i++) {
+    Entry *entry = &table->entries[i];
+    relocate((Obj **)&entry->key);
+    relocateValue(&entry->value, relocate);
+  }
+}
+
+static void relocateInlineCaches(Chunk *chunk, Relocate relocate) {
+  for (int i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    for (int way = 0; way < INLINE_CACHE_WAYS; way++) {
+      relocate((Obj **)&cache->ways[way].shape);
+      relocate((Obj **)&cache->ways[way].transition);
+      relocate((Obj **)&cache->ways[way].method);
+    }
+  }
+}
+
+// relocate the objects `object` references, as `blackenObject()` marks them
+static void relocateReferences(Obj *object, Relocate relocate) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    relocateValue(&bound->receiver, relocate);
+    relocate((Obj **)&bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    relocate((Obj **)&klass->name);
+    relocateTable(&klass->methods, relocate);
+    relocate((Obj **)&klass->rootShape);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    relocate((Obj **)&closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      relocate((Obj **)&closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    relocate((Obj **)&function->name);
+    relocateArray(&function->chunk.constants, relocate);
+    relocateInlineCaches(&function->chunk, relocate);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    relocate((Obj **)&instance->shape);
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      relocateValue(&instance->fields[i], relocate);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    relocate((Obj **)&shape->klass);
+    relocate((Obj **)&shape->parent);
+    relocate((Obj **)&shape->name);
+    relocateTable(&shape->transitions, relocate);
+    break;
+  }
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    relocate(&rope->left);
+    relocate(&rope->right);
+    relocate((Obj **)&rope->flat);
+    break;
+  }
+  case OBJ_UPVALUE:
+    relocateValue(&((ObjUpvalue *)object)->closed, relocate);
+    break;
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+// the roots of `markRoots()`, but the compiler's: it has no safepoint.
+static void relocateRoots(Relocate relocate) {
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    relocateValue(slot, relocate);
+  }
+  clearDeadStack();
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    relocate((Obj **)&vm.frames[i].closure);
+  }
+
+  // the links of the list itself are updated
+  for (ObjUpvalue **upvalue = &vm.openUpvalues; *upvalue != NULL;
+       upvalue = &(*upvalue)->next) {
+    relocate((Obj **)upvalue);
+  }
+
+  relocateTable(&vm.globalSlots, relocate);
+  relocateArray(&vm.globalValues, relocate);
+  relocateArray(&vm.globalNames, relocate);
+
+  relocate((Obj **)&vm.initString);
+}
+
+// the young gray objects of an incremental marking are replaced with
+// their copy, or dropped if they died since.
+static void forwardGrayObjects(void) {
+  int count = 0;
+  for (int i = 0; i < vm.grayCount; i++) {
+    Obj *object = vm.grayStack[i];
+    if (isYoung(object)) {
+      object = object->next;
+    }
+    if (object != NULL) {
+      vm.grayStack[count++] = object;
+    }
+  }
+  vm.grayCount = count;
+}
+
+/**
+ * Once the survivors are copied, empty the nursery. The dead objects
+ * free the memory they own, and leave the string table (which doesn't
+ * keep them alive), where the promoted ones replace their original.
+ * Strings never compared aren't in it (see `internString()`).
+ */
+static void sweepNursery(void) {
+  for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+    Obj *object = (Obj *)cursor;
+    cursor += ALIGN_OBJECT(objectSize(object));
+    bool interned =
+        object->type == OBJ_STRING && ((ObjString *)object)->isInterned;
+    if (object->next != NULL) {
+      if (interned) {
+        tableReplaceKey(&vm.strings, (ObjString *)object,
+                        (ObjString *)object->next);
+      }
+    } else {
+      if (interned) {
+        tableDelete(&vm.strings, (ObjString *)object);
+      }
+      freeObjectContents(object);
+    }
+  }
+  vm.nurseryTop = vm.nursery;
+}
+
+// sparsest pages first
+static int compareFreeCells(const void *a, const void *b) {
+  return (*(Page *const *)b)->freeCount - (*(Page *const *)a)->freeCount;
+}
+
+/**
+ * Choose the pages of class `sizeClass` to evacuate: the sparsest ones,
+ * as long as the others have room for their objects. The others are the
+ * only ones left in `vm.freePages`, the copies are allocated there.
+ */
+static void chooseEvacuated(int sizeClass, PointerStack *pages) {
+  pages->count = 0;
+  int freeCells = 0;
+  for (Page *page = vm.pages; page != NULL; page = page->next) {
+    if (page->sizeClass == sizeClass) {
+      pushPointer(pages, page);
+      freeCells += page->freeCount;
+    }
+  }
+  if (pages->count > 1) {
+    qsort(pages->items, pages->count, sizeof(Page *), compareFreeCells);
+  }
+  int moving = 0;
+  for (int i = 0; i < pages->count; i++) {
+    Page *page = (Page *)pages->items[i];
+    moving += page->cellCount - page->freeCount;
+    freeCells -= page->freeCount;
+    if (moving > freeCells) {
+      break;
+    }
+    page->evacuated = true;
+  }
+
+  vm.freePages[sizeClass] = NULL;
+  for (int i = pages->count - 1; i >= 0; i--) {
+    Page *page = (Page *)pages->items[i];
+    if (!page->evacuated && page->freeCount > 0) {
+      page->nextFree = vm.freePages[sizeClass];
+      vm.freePages[sizeClass] = page;
+    }
+  }
+}
+
+// copy the objects of an evacuated page, leaving their address in `next`
+static void evacuatePage(Page *page) {
+  for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+    for (uint64_t cells = page->allocated[word]; cells != 0;
+         cells &= cells - 1) {
+      size_t granule = (size_t)word * 64 + __builtin_ctzll(cells);
+      Obj *object = (Obj *)((uint8_t *)page + granule * CELL_GRANULE);
+      size_t size = objectSize(object);
+      Obj *copy = allocateCell(size);
+      moveObject(object, copy, size);
+      // marked, like every old object between two collections
+      setMarked(copy, true);
+      copy->next = NULL;
+      object->next = copy;
+      vm.gcStats.compactedBytes += size;
+    }
+  }
+}
+
+/**
+ * Compaction, right after a minor collection: the nursery and the
+ * remembered set are empty, the old generation is swept. The sparsest
+ * pages of each size class are evacuated into the others, then every
+ * reference is forwarded: from the roots, from the objects of the pages
+ * kept, and from the string table. The evacuated pages are released.
+ */
+static void compactHeap(void) {
+  double start = now();
+  PointerStack pages = {0};
+  // large objects stay where they are
+  for (int sizeClass = 0; sizeClass < GC_LARGE_CLASS; sizeClass++) {
+    chooseEvacuated(sizeClass, &pages);
+  }
+  free(pages.items);
+  vm.gcCompactPending = false;
+  bool moved = false;
+  for (Page *page = vm.pages; page != NULL; page = page->next) {
+    if (page->evacuated) {
+      evacuatePage(page);
+      moved = true;
+    }
+  }
+  if (!moved) {
+    return;
+  }
+
+  relocateRoots(forwardObject);
+  relocateTable(&vm.strings, forwardObject);
+  for (Page *page = vm.pages; page != NULL; page = page->next) {
+    if (page->evacuated) {
+      continue;
+    }
+    for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+      for (uint64_t cells = page->allocated[word]; cells != 0;
+           cells &= cells - 1) {
+        size_t granule = (size_t)word * 64 + __builtin_ctzll(cells);
+        relocateReferences((Obj *)((uint8_t *)page + granule * CELL_GRANULE),
+                           forwardObject);
+      }
+    }
+  }
+
+  Page **link = &vm.pages;
+  while (*link != NULL) {
+    Page *page = *link;
+    if (page->evacuated) {
+      *link = page->next;
+      free(page);
+      vm.gcStats.releasedPages++;
+    } else {
+      link = &page->next;
+    }
+  }
+
+  double pause = now() - start;
+  vm.gcStats.compactCount++;
+  vm.gcStats.compactTime += pause;
+  recordPause(pause);
+}
+
+/**
+ * Minor collection, only called at safepoints (see the top of this file):
+ * promote the young objects reachable from the roots or from the
+ * remembered old objects, then empty the nursery.
+ * Runs a major collection after it, if the old generation grew enough.
+ */
+void collectNursery(void) {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t used = vm.nurseryTop - vm.nursery;
+  size_t promoted = vm.gcStats.promotedBytes;
+#endif
+  double start = now();
+  relocateRoots(promoteObject);
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    relocateReferences(vm.remembered[i], promoteObject);
+  }
+  vm.rememberedCount = 0;
+  while (promoted.count > 0) {
+    relocateReferences(promoted.items[--promoted.count], promoteObject);
+  }
+  if (vm.gcPhase == GC_MARK) {
+    forwardGrayObjects();
+  }
+  sweepNursery();
+  memset(nurseryMarks, 0, sizeof(nurseryMarks));
+  vm.nurseryFull = false;
+
+  double pause = now() - start;
+  vm.gcStats.minorCount++;
+  vm.gcStats.minorTime += pause;
+  if (pause > vm.gcStats.minorMaxPause) {
+    vm.gcStats.minorMaxPause = pause;
+  }
+  recordPause(pause);
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu of %zu bytes\n",
+         vm.gcStats.promotedBytes - promoted, used);
+#endif
+
+  if (vm.gcCompactPending && vm.gcPhase == GC_IDLE) {
+    compactHeap();
+  }
+
+#ifdef CONCURRENT_GC
+  if (vm.gcConcurrent && vm.gcPhase == GC_IDLE &&
+      vm.bytesAllocated > vm.nextGC) {
+    startConcurrentMarking();
+    return;
+  }
+#endif
+  pollMajor();
+}
+
+static void freePages(Page *page) {
+  while (page != NULL) {
+    Page *next = page->next;
+    for (int i = 0; i < page->cellCount; i++) {
+      Obj *cell = pageCell(page, i);
+      if (isAllocated(page, granuleOf(cell))) {
+        freeObject(cell);
+      }
+    }
+    free(page);
+    page = next;
+  }
+}
+
 void freeObjects(void) {
-  Obj *obj = vm.objects;
-  while (obj != NULL) {
-    Obj *next = obj->next;
-    freeObject(obj);
-    obj = next;
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_CONCURRENT_MARK) {
+    joinMarker();
+  }
+  free(marker.queue.items);
+  free(marker.shaded.items);
+  free(marker.deferred.items);
+#endif
+  freePages(vm.pages);
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    freePages(vm.sweepPages[i]);
+  }
+  for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+    Obj *young = (Obj *)cursor;
+    cursor += ALIGN_OBJECT(objectSize(young));
+    freeObjectContents(young);
   }
+  free(vm.nursery);
+  free(vm.remembered);
   free(vm.grayStack);
+  free(promoted.items);
+#ifdef PARALLEL_GC
+  for (int i = 0; i < GC_MAX_THREADS; i++) {
+    free(workers[i].array);
+    free(workers[i].retired.items);
+  }
+#endif
+}
+
+// print the number of collections and their pauses, per generation
+void printGCStats(void) {
+  GCStats *stats = &vm.gcStats;
+  fprintf(stderr, "-- gc\n");
+  fprintf(stderr,
+          "   minor %8d collections %10.3f ms (max pause %.3f ms), "
+          "%zu KiB promoted\n",
+          stats->minorCount, stats->minorTime * 1e3,
+          stats->minorMaxPause * 1e3, stats->promotedBytes / 1024);
+  fprintf(stderr,
+          "   major %8d collections %10.3f ms (max pause %.3f ms), "
+          "%d slices\n",
+          stats->majorCount, stats->majorTime * 1e3,
+          stats->majorMaxPause * 1e3, stats->sliceCount);
+  fprintf(stderr, "   total %30.3f ms\n",
+          (stats->minorTime + stats->majorTime) * 1e3);
+  if (stats->traceTime > 0) {
+    fprintf(stderr, "   tracing %28.3f ms, %d threads\n",
+            stats->traceTime * 1e3, vm.gcThreads);
+  }
+  if (stats->lazySweepTime > 0) {
+    fprintf(stderr, "   lazy sweeping %22.3f ms\n", stats->lazySweepTime * 1e3);
+  }
+  if (stats->markerTime > 0) {
+    fprintf(stderr, "   marker thread %22.3f ms\n", stats->markerTime * 1e3);
+  }
+  if (stats->compactCount > 0) {
+    fprintf(stderr,
+            "   compact %6d compactions %10.3f ms, %zu KiB moved, "
+            "%zu pages released\n",
+            stats->compactCount, stats->compactTime * 1e3,
+            stats->compactedBytes / 1024, stats->releasedPages);
+  }
+  fprintf(stderr, "   pauses\n");
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (stats->pauseHistogram[i] == 0) {
+      continue;
+    }
+    if (i < GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "   < %6d us %8d\n", 1 << i, stats->pauseHistogram[i]);
+    } else {
+      fprintf(stderr, "   >= %5d us %8d\n", 1 << (i - 1),
+              stats->pauseHistogram[i]);
+    }
+  }
+}
+
+static void printTableKind(const char *kind, TableStats *stats) {
+  fprintf(stderr,
+          "   %-8s %6d tables %8ld entries %9ld slots %10ld bytes (%7.1f "
+          "avg), probe length %5.2f avg %4d max\n",
+          kind, stats->tables, stats->entries, stats->capacity, stats->bytes,
+          stats->tables == 0 ? 0. : (double)stats->bytes / stats->tables,
+          stats->entries == 0 ? 0. : (double)stats->probes / stats->entries,
+          stats->maxProbe);
+}
+
+// add the tables of `object` to their kind
+static void objectTableStats(Obj *object, TableStats *methods,
+                             TableStats *fields) {
+  if (object->type == OBJ_CLASS) {
+    tableStats(&((ObjClass *)object)->methods, methods);
+  } else if (object->type == OBJ_SHAPE) {
+    // instances keep their fields in arrays: a shape maps the name of the
+    // next field to the shape of instances that have it too
+    tableStats(&((ObjShape *)object)->transitions, fields);
+  }
+}
+
+/**
+ * Print the sizes and probe lengths of the tables, by kind. Those of
+ * classes and shapes are found walking the heap: dead ones not swept yet
+ * count too.
+ */
+void printTableStats(void) {
+  TableStats globals = {0}, strings = {0}, methods = {0}, fields = {0};
+  tableStats(&vm.globalSlots, &globals);
+  tableStats(&vm.strings, &strings);
+  for (uint8_t *cursor = vm.nursery; cursor < vm.nurseryTop;) {
+    Obj *object = (Obj *)cursor;
+    cursor += ALIGN_OBJECT(objectSize(object));
+    objectTableStats(object, &methods, &fields);
+  }
+  for (int list = -1; list < GC_SIZE_CLASSES; list++) {
+    Page *page = list < 0 ? vm.pages : vm.sweepPages[list];
+    for (; page != NULL; page = page->next) {
+      for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+        for (uint64_t cells = page->allocated[word]; cells != 0;
+             cells &= cells - 1) {
+          size_t granule = (size_t)word * 64 + __builtin_ctzll(cells);
+          objectTableStats(
+              (Obj *)((uint8_t *)page + granule * CELL_GRANULE), &methods,
+              &fields);
+        }
+      }
+    }
+  }
+  fprintf(stderr, "-- tables\n");
+  printTableKind("globals", &globals);
+  printTableKind("strings", &strings);
+  printTableKind("methods", &methods);
+  printTableKind("fields", &fields);
 }
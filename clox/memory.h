@@ -3,8 +3,9 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
-#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * count)
+#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
 // parenthesis handle expressions
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
@@ -18,10 +19,80 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// size (in bytes) of the nursery, where new objects are allocated.
+// Build with `-DNURSERY_SIZE=...` to change it.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+// default pause budget (in µs) of an incremental major collection slice,
+// see `--gc-incremental`.
+#define GC_SLICE_BUDGET 500
+
+// default occupancy (in percent) of the old generation pages under which
+// they get compacted, see `--gc-compact`.
+#define GC_COMPACT_THRESHOLD 50
+
+// bytes the old generation grows by between two slices
+#define GC_SLICE_BYTES (64 * 1024)
+
+// most threads `--gc-threads` can mark with
+#define GC_MAX_THREADS 64
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+Obj *heapAllocate(size_t size);
 void markObject(Obj *object);
+bool isMarked(Obj *object);
 void markValue(Value value);
+void rememberObject(Obj *object);
+#ifdef CONCURRENT_GC
+void shadeObject(Obj *object);
+#endif
+void collectNursery(void);
 void collectGarbage(void);
 void freeObjects(void);
+void printGCStats(void);
+void printTableStats(void);
+
+// whether `object` lives in the nursery
+static inline bool isYoung(Obj *object) {
+  return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+/**
+ * Write barrier: `object` references `value`, no allocation may happen
+ * between the store and the barrier.
+ * Old objects referencing young ones are remembered, the next minor
+ * collection scans them (see `collectNursery()`).
+ * While an incremental major collection marks, marked objects must not
+ * reference unmarked ones (Dijkstra): `value` is marked too.
+ */
+static inline void writeBarrier(Obj *object, Value value) {
+  if (!IS_OBJ(value)) {
+    return;
+  }
+  if (!isYoung(object) && isYoung(AS_OBJ(value)) && !object->isRemembered) {
+    rememberObject(object);
+  }
+  if (vm.gcPhase == GC_MARK && isMarked(object)) {
+    markObject(AS_OBJ(value));
+  }
+}
+
+/**
+ * Deletion barrier: `old` is about to be overwritten in a heap object.
+ * While the background thread marks, everything reachable when it
+ * started must get marked (snapshot at the beginning): the references
+ * the program drops are marked first (see `shadeObject()`).
+ */
+static inline void deletionBarrier(Value old) {
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_CONCURRENT_MARK && IS_OBJ(old)) {
+    shadeObject(AS_OBJ(old));
+  }
+#else
+  (void)old;
+#endif
+}
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -11,11 +12,8 @@
   (type *)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  Obj *object = heapAllocate(size);
   object->type = type;
-  object->isMarked = false;
-  object->next = vm.objects;
-  vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for type %d\n", (void *)object, size, object->type);
@@ -30,12 +28,30 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   return bound;
 }
 
+static ObjShape *newShape(ObjClass *klass, ObjShape *parent,
+                          ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
 ObjClass *newClass(ObjString *name) {
   // we use `klass` to avoid collision with the reserved class keyword,
   // if one wants to use a C++ compiler
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
+  klass->version = 0;
+  klass->rootShape = NULL;
+  klass->inlineFields = 0;
   initTable(&klass->methods);
+  push(OBJ_VAL(klass)); // so GC can see it while allocating its shape
+  klass->rootShape = newShape(klass, NULL, NULL);
+  writeBarrier((Obj *)klass, OBJ_VAL(klass->rootShape));
+  pop();
   return klass;
 }
 
@@ -51,13 +67,109 @@ ObjClosure *newClosure(ObjFunction *function) {
   return closure;
 }
 
+/**
+ * Allocate an instance without any field, with enough inline storage for
+ * the number of fields the previous instances of `klass` ended up with.
+ */
 ObjInstance *newInstance(ObjClass *klass) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-  instance->klass = klass;
-  initTable(&instance->fields);
+  int inlineCapacity = klass->inlineFields;
+  ObjInstance *instance = (ObjInstance *)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
+  instance->shape = klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->capacity = inlineCapacity;
+  instance->inlineCapacity = inlineCapacity;
   return instance;
 }
 
+/**
+ * Return the index of the field `name` in the instances of shape `shape`,
+ * or -1 if they don't have such a field.
+ */
+int shapeFieldIndex(ObjShape *shape, ObjString *name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) {
+      return shape->fieldCount - 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Return the shape adding the field `name` to `shape`,
+ * create it if this transition was never taken before.
+ */
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+  ObjShape *child = newShape(shape->klass, shape, name);
+  push(OBJ_VAL(child)); // so GC can see it while executing `tableSet()`
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier((Obj *)shape, OBJ_VAL(name));
+  writeBarrier((Obj *)shape, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+  int index = shapeFieldIndex(instance->shape, name);
+  if (index == -1) {
+    return false;
+  }
+  *value = instance->fields[index];
+  return true;
+}
+
+// move the fields out of the inline storage into a larger array.
+static void growFields(ObjInstance *instance) {
+  int capacity = GROW_CAPACITY(instance->capacity);
+  Value *fields = ALLOCATE(Value, capacity);
+  memcpy(fields, instance->fields, sizeof(Value) * instance->capacity);
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+  }
+  // copied before a concurrent marker can see them
+  __atomic_store_n(&instance->fields, fields, __ATOMIC_RELEASE);
+  instance->capacity = capacity;
+}
+
+/**
+ * Set the field `name` of `instance`, add it if needed (which changes the
+ * shape of `instance`).
+ * Assumes that `instance` and `value` are reachable by the GC.
+ * The new shape is stored last: a concurrent marker reading it sees the
+ * field it adds (see `blackenObject()`).
+ */
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value) {
+  int index = shapeFieldIndex(instance->shape, name);
+  if (index != -1) {
+    deletionBarrier(instance->fields[index]);
+    writeBarrier((Obj *)instance, value);
+    instance->fields[index] = value;
+    return;
+  }
+
+  ObjShape *shape = shapeTransition(instance->shape, name);
+  index = shape->fieldCount - 1;
+  if (index >= instance->capacity) {
+    growFields(instance);
+  }
+  writeBarrier((Obj *)instance, value);
+  instance->fields[index] = value;
+  writeBarrier((Obj *)instance, OBJ_VAL(shape));
+  deletionBarrier(OBJ_VAL(instance->shape));
+  __atomic_store_n(&instance->shape, shape, __ATOMIC_RELEASE);
+
+  // the next instances of this class will store as many fields inline.
+  ObjClass *klass = shape->klass;
+  if (shape->fieldCount > klass->inlineFields &&
+      shape->fieldCount <= INSTANCE_INLINE_FIELDS_MAX) {
+    klass->inlineFields = shape->fieldCount;
+  }
+}
+
 /**
  * Allocate new ObjFunction,
  * (without name, code, or arity).
@@ -67,6 +179,9 @@ ObjFunction *newFunction() {
   function->arity = 0;
   function->name = NULL;
   function->upvalueCount = 0;
+  function->stackSize = 0;
+  function->hotness = 0;
+  function->jitCode = NULL;
   initChunk(&function->chunk);
   return function;
 }
@@ -80,19 +195,22 @@ ObjNative *newNative(NativeFn function) {
   return native;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/**
+ * Allocate a string of `length` chars, for the caller to fill. It is
+ * neither hashed nor interned until compared (see `internString()`).
+ */
+ObjString *allocateString(int length) {
+  ObjString *string =
+      (ObjString *)allocateObject(STRING_SIZE(length), OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  push(OBJ_VAL(string)); // so GC can see it while executing `tableSet()`
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
+  string->hash = 0;
+  string->isInterned = false;
+  string->chars[length] = '\0';
   return string;
 }
 
 /**
- * "FNV-1a" hash algorithm.
+ * "FNV-1a" hash algorithm. Never 0, that marks strings not hashed yet.
  */
 uint32_t hashString(const char *key, int length) {
 
@@ -101,21 +219,37 @@ uint32_t hashString(const char *key, int length) {
     hash ^= (uint32_t)key[i];
     hash *= 16777619;
   }
-  return hash;
+  return hash != 0 ? hash : 1;
 }
 
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
+// add a string, already hashed, to the interned ones
+static ObjString *addInterned(ObjString *string) {
+  string->isInterned = true;
+  push(OBJ_VAL(string)); // so GC can see it while executing `tableSet()`
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
+  return string;
+}
 
-  // if an interned string exists,
-  // return it, and drop `chars`
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+/**
+ * The interned string equal to `string`: itself, or the one interned
+ * before it. Strings built at runtime are only hashed and interned here,
+ * when they need an identity (a flattened rope); comparing them doesn't.
+ * Allocates.
+ */
+ObjString *internString(ObjString *string) {
+  if (string->isInterned) {
+    return string;
+  }
+  if (string->hash == 0) {
+    string->hash = hashString(string->chars, string->length);
+  }
+  ObjString *interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
-
-  return allocateString(chars, length, hash);
+  return addInterned(string);
 }
 
 ObjString *copyString(const char *chars, int length) {
@@ -126,10 +260,145 @@ ObjString *copyString(const char *chars, int length) {
   if (interned != NULL)
     return interned;
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  return addInterned(string);
+}
+
+static inline int stringLength(Obj *string) {
+  return string->type == OBJ_ROPE ? ((ObjRope *)string)->length
+                                  : ((ObjString *)string)->length;
+}
+
+/**
+ * Concatenate 2 strings (flat or ropes), the caller keeps them reachable
+ * for GC. Short results are copied, longer ones are ropes: repeated
+ * concatenation only copies characters once, when flattened.
+ */
+Obj *concatenateStrings(Obj *a, Obj *b) {
+  int length = stringLength(a) + stringLength(b);
+  if (length < ROPE_MIN_LENGTH) {
+    // then neither is a rope
+    ObjString *result = allocateString(length);
+    memcpy(result->chars, ((ObjString *)a)->chars, ((ObjString *)a)->length);
+    memcpy(result->chars + ((ObjString *)a)->length, ((ObjString *)b)->chars,
+           ((ObjString *)b)->length);
+    return (Obj *)result;
+  }
+  if (stringLength(a) == 0) {
+    return b;
+  }
+  if (stringLength(b) == 0) {
+    return a;
+  }
+  // no need to keep the pieces of flattened ropes
+  if (a->type == OBJ_ROPE && ((ObjRope *)a)->flat != NULL) {
+    a = (Obj *)((ObjRope *)a)->flat;
+  }
+  if (b->type == OBJ_ROPE && ((ObjRope *)b)->flat != NULL) {
+    b = (Obj *)((ObjRope *)b)->flat;
+  }
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = a;
+  rope->right = b;
+  rope->flat = NULL;
+  return (Obj *)rope;
+}
+
+/**
+ * Call `visit` on the flat pieces of `string` (flat or a rope), in order.
+ * Iterative: a rope built by a loop is as deep as it has pieces.
+ */
+static void forEachPiece(Obj *string, void (*visit)(ObjString *, void *),
+                         void *context) {
+  Obj **stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  for (;;) {
+    if (string->type == OBJ_ROPE && ((ObjRope *)string)->flat != NULL) {
+      string = (Obj *)((ObjRope *)string)->flat;
+    }
+    if (string->type == OBJ_ROPE) {
+      // system memory, like the gray stack: no collection while walking
+      if (capacity < count + 1) {
+        capacity = GROW_CAPACITY(capacity);
+        stack = (Obj **)realloc(stack, sizeof(Obj *) * capacity);
+        if (stack == NULL) {
+          exit(1);
+        }
+      }
+      stack[count++] = ((ObjRope *)string)->right;
+      string = ((ObjRope *)string)->left;
+      continue;
+    }
+    visit((ObjString *)string, context);
+    if (count == 0) {
+      break;
+    }
+    string = stack[--count];
+  }
+  free(stack);
+}
+
+static void appendPiece(ObjString *piece, void *context) {
+  char **end = (char **)context;
+  memcpy(*end, piece->chars, piece->length);
+  *end += piece->length;
+}
+
+/**
+ * The interned string with the characters of `rope`, built the first time
+ * and kept: the rope drops its pieces then. Allocates, the caller keeps
+ * the rope reachable.
+ */
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    return rope->flat;
+  }
+  ObjString *string = allocateString(rope->length);
+  char *end = string->chars;
+  forEachPiece((Obj *)rope, appendPiece, &end);
+  string = internString(string);
+
+  deletionBarrier(OBJ_VAL(rope->left));
+  deletionBarrier(OBJ_VAL(rope->right));
+  rope->left = NULL;
+  rope->right = NULL;
+  rope->flat = string;
+  writeBarrier((Obj *)rope, OBJ_VAL(string));
+  return string;
+}
+
+/**
+ * Equality of two objects that aren't the same one: two interned strings
+ * differ, others need their characters compared (a rope once flattened).
+ * Allocates.
+ */
+bool stringsEqual(Obj *a, Obj *b) {
+  if (a->type == OBJ_STRING && b->type == OBJ_STRING &&
+      ((ObjString *)a)->isInterned && ((ObjString *)b)->isInterned) {
+    return false;
+  }
+  if ((a->type != OBJ_STRING && a->type != OBJ_ROPE) ||
+      (b->type != OBJ_STRING && b->type != OBJ_ROPE) ||
+      stringLength(a) != stringLength(b)) {
+    return false;
+  }
+  if (a->type == OBJ_ROPE) {
+    a = (Obj *)flattenRope((ObjRope *)a);
+  }
+  if (b->type == OBJ_ROPE) {
+    b = (Obj *)flattenRope((ObjRope *)b);
+  }
+  ObjString *left = (ObjString *)a;
+  ObjString *right = (ObjString *)b;
+  if (left->isInterned && right->isInterned) {
+    return left == right;
+  }
+  // cheaper than interning: no hash, no table lookup
+  return memcmp(left->chars, right->chars, left->length) == 0;
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -148,6 +417,11 @@ static void printFunction(ObjFunction *function) {
   printf("<fn %s>", function->name->chars);
 }
 
+static void printPiece(ObjString *piece, void *unused) {
+  (void)unused;
+  fwrite(piece->chars, 1, piece->length, stdout);
+}
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_BOUND_METHOD:
@@ -163,11 +437,19 @@ void printObject(Value value) {
     printFunction(AS_FUNCTION(value));
     break;
   case OBJ_INSTANCE:
-    printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+    printf("%s instance", AS_INSTANCE(value)->shape->klass->name->chars);
     break;
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_ROPE:
+    // piece by piece: printing doesn't need it flattened
+    forEachPiece(AS_OBJ(value), printPiece, NULL);
+    break;
+  case OBJ_SHAPE:
+    // unreachable by users
+    printf("shape");
+    break;
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
     break;
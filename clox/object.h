@@ -14,7 +14,11 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+// a string, flat or a rope: what `+` concatenates
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
@@ -22,6 +26,8 @@
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
@@ -32,6 +38,8 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
@@ -39,7 +47,9 @@ typedef enum {
 // mockup inheritance, see ObjFunction, ObjString, ...
 struct Obj {
   ObjType type;
-  bool isMarked;
+  bool isRemembered; // old object in `vm.remembered` (see `writeBarrier()`)
+  // a young object: NULL until a minor collection copies it, then its copy.
+  // The marks are kept apart, in bitmaps (see memory.c).
   struct Obj *next;
 };
 
@@ -49,6 +59,9 @@ typedef struct {
   int upvalueCount; // number of ref to outer function locals
   Chunk chunk;
   ObjString *name;
+  int stackSize; // stack slots used by a frame: locals and temporaries
+  int hotness; // calls and loop iterations, until compiled (see jit.h)
+  struct JitCode *jitCode; // machine code, NULL until compiled
 } ObjFunction;
 
 // Native function pointers
@@ -63,10 +76,31 @@ typedef struct {
 struct ObjString {
   Obj obj;    // because #[repr(C)]: `(obj*) &ObjString` is valid.
   int length; // EXCLUDING trailing '\0'
-  char *chars;
-  uint32_t hash; // not garanteed to be uniq per string.
+  uint32_t hash; // not garanteed to be uniq per string. 0: not hashed yet
+  // in `vm.strings`: literals from the start, strings built at runtime only
+  // once they need an identity (see `internString()`)
+  bool isInterned;
+  char chars[]; // stored right after the header, in the same allocation
 };
 
+// bytes taken by a string of `length` chars
+#define STRING_SIZE(length) (offsetof(ObjString, chars) + (length) + 1)
+
+// concatenations shorter than that are copied, longer ones make ropes
+#define ROPE_MIN_LENGTH 64
+
+/**
+ * Concatenation of two strings (flat or ropes), made in constant time:
+ * its characters are only copied once needed (see `flattenRope()`).
+ */
+typedef struct {
+  Obj obj;
+  int length;      // at least ROPE_MIN_LENGTH
+  Obj *left;       // NULL once flattened
+  Obj *right;      // NULL once flattened
+  ObjString *flat; // the interned string it was flattened to, or NULL
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location;         // point to function stack frame
@@ -74,23 +108,54 @@ typedef struct ObjUpvalue {
   Value closed;            // Copy of what used to be a stackframe local
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj; // because #[repr(C)]: `(obj*) &ObjClosure` is valid.
   ObjFunction *function;
   ObjUpvalue **upvalues; // refs to outer function locals
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+// never give more than this number of fields to the inline storage of
+// an instance.
+#define INSTANCE_INLINE_FIELDS_MAX 16
+
+typedef struct ObjShape ObjShape;
+
+typedef struct ObjClass {
   Obj obj; // because #[repr(C)]: `(obj*) &ObjClass` is valid.
   ObjString *name;
   Table methods;
+  int version; // bumped when `methods` changes, invalidates inline caches
+  ObjShape *rootShape; // shape of the instances without any field
+  int inlineFields;    // largest number of fields seen in an instance, used
+                       // to size the inline storage of the next ones.
 } ObjClass;
 
+/**
+ * "Hidden class" of an instance: the names of its fields, in insertion
+ * order.
+ * Shapes form a transition tree rooted at the class `rootShape`:
+ * each shape adds one field (`name`) to its parent. Instances
+ * filled in the same order share the same shape, so a field lives at the
+ * same index of their `fields` array.
+ */
+struct ObjShape {
+  Obj obj;
+  ObjClass *klass;         // shapes are not shared between classes
+  struct ObjShape *parent; // shape without the last field, NULL for the root
+  ObjString *name;         // name of the last field, NULL for the root
+  int fieldCount;          // `name` is the field at index `fieldCount - 1`
+  Table transitions;       // field name -> shape adding it to this one
+};
+
 typedef struct {
   Obj obj;
-  ObjClass *klass;
-  Table fields;
+  ObjShape *shape; // field names, and (through the shape) the class
+  Value *fields;   // field values, ordered as in `shape`
+  int capacity;    // length of `fields`
+  int inlineCapacity; // length of `inlineFields`
+  // `fields` points here, until the instance outgrows it.
+  Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -104,10 +169,18 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *);
 ObjClass *newClass(ObjString *name);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
+int shapeFieldIndex(ObjShape *shape, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 ObjClosure *newClosure(ObjFunction *function);
 ObjNative *newNative(NativeFn function);
-ObjString *takeString(char *chars, int length);
+ObjString *allocateString(int length);
+ObjString *internString(ObjString *string);
 ObjString *copyString(const char *chars, int length);
+Obj *concatenateStrings(Obj *a, Obj *b);
+ObjString *flattenRope(ObjRope *rope);
+bool stringsEqual(Obj *a, Obj *b);
 ObjUpvalue *newUpvalue(Value *slot);
 void printObject(Value value);
 
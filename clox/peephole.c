@@ -0,0 +1,172 @@
+#include "peephole.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * Peephole pass, run on each chunk once the compiler is done with it.
+ *
+ * It fuses the most frequent instruction sequences (as reported by
+ * `DEBUG_OPCODE_PAIRS`) into superinstructions, which saves dispatches
+ * and stack traffic:
+ *
+ * * `OP_JUMP_IF_FALSE; OP_POP` -> `OP_POP_JUMP_IF_FALSE`
+ * * `OP_NOT; OP_JUMP_IF_FALSE; OP_POP` -> `OP_POP_JUMP_IF_TRUE`
+ * * `OP_LESS; OP_JUMP_IF_FALSE; OP_POP` -> `OP_JUMP_IF_NOT_LESS`
+ * * `OP_GREATER; OP_JUMP_IF_FALSE; OP_POP` -> `OP_JUMP_IF_NOT_GREATER`
+ * * `OP_CONSTANT (number); OP_ADD` -> `OP_ADD_CONSTANT`
+ * * `OP_CONSTANT (number); OP_SUBSTRACT` -> `OP_SUBSTRACT_CONSTANT`
+ * * `OP_SET_LOCAL; OP_POP` -> `OP_SET_LOCAL_POP`
+ * * `OP_SET_GLOBAL; OP_POP` -> `OP_SET_GLOBAL_POP`
+ *
+ * `OP_JUMP_IF_FALSE` leaves the condition on the stack, so both of its
+ * branches start with an `OP_POP`. The fused jumps pop the condition
+ * themselves, and land right after the `OP_POP` of their target.
+ *
+ * Fused instructions are never longer than the sequence they replace:
+ * the chunk is rewritten in place, then jump offsets are recomputed.
+ */
+
+// `OP_JUMP_IF_FALSE; OP_POP` whose target also starts with `OP_POP`
+static bool isPopJump(Chunk *chunk, int offset, bool *isTarget) {
+  if (offset + 3 >= chunk->count || chunk->code[offset] != OP_JUMP_IF_FALSE ||
+      chunk->code[offset + 3] != OP_POP || isTarget[offset + 3]) {
+    return false;
+  }
+  int target = jumpTarget(chunk, offset);
+  return target < chunk->count && chunk->code[target] == OP_POP;
+}
+
+// a jump, waiting for its offset
+typedef struct {
+  int offset; // offset of the jump instruction, in the optimized chunk
+  int target; // offset of the target, in the original chunk
+} PendingJump;
+
+void optimizeChunk(Chunk *chunk) {
+  int count = chunk->count;
+  if (count == 0)
+    return;
+
+  // offsets (in the original chunk) that some jump lands on. A sequence
+  // can only be fused if no jump lands in the middle of it.
+  bool *isTarget = ALLOCATE(bool, count + 1);
+  for (int i = 0; i <= count; i++) {
+    isTarget[i] = false;
+  }
+  for (int offset = 0; offset < count;
+       offset += instructionLength(chunk, offset)) {
+    if (isJumpInstruction(chunk->code[offset])) {
+      int target = jumpTarget(chunk, offset);
+      isTarget[target] = true;
+      // a fused jump might land after the `OP_POP` of its target
+      if (target < count && chunk->code[target] == OP_POP) {
+        isTarget[target + 1] = true;
+      }
+    }
+  }
+
+  // new offset of each instruction, indexed by its original offset
+  int *newOffsets = ALLOCATE(int, count + 1);
+  PendingJump *jumps = ALLOCATE(PendingJump, count);
+  int jumpCount = 0;
+
+  uint8_t *code = chunk->code;
+  int write = 0;
+  int read = 0;
+  while (read < count) {
+    newOffsets[read] = write;
+    int line = chunk->lines[read];
+    uint8_t instruction = code[read];
+    uint8_t fused = instruction;
+    int length = instructionLength(chunk, read);
+    int target = -1;
+
+    switch (instruction) {
+    case OP_JUMP_IF_FALSE:
+      if (isPopJump(chunk, read, isTarget)) {
+        fused = OP_POP_JUMP_IF_FALSE;
+        target = jumpTarget(chunk, read) + 1;
+        length = 4;
+      }
+      break;
+    case OP_NOT:
+    case OP_LESS:
+    case OP_GREATER:
+      if (!isTarget[read + 1] && isPopJump(chunk, read + 1, isTarget)) {
+        fused = instruction == OP_NOT    ? OP_POP_JUMP_IF_TRUE
+                : instruction == OP_LESS ? OP_JUMP_IF_NOT_LESS
+                                         : OP_JUMP_IF_NOT_GREATER;
+        target = jumpTarget(chunk, read + 1) + 1;
+        length = 5;
+      }
+      break;
+    case OP_CONSTANT:
+      if (read + 2 < count && !isTarget[read + 2] &&
+          (code[read + 2] == OP_ADD || code[read + 2] == OP_SUBSTRACT) &&
+          IS_NUMBER(chunk->constants.values[code[read + 1]])) {
+        fused = code[read + 2] == OP_ADD ? OP_ADD_CONSTANT
+                                         : OP_SUBSTRACT_CONSTANT;
+        length = 3;
+      }
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+      if (read + length < count && !isTarget[read + length] &&
+          code[read + length] == OP_POP) {
+        fused =
+            instruction == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+        length++;
+      }
+      break;
+    default:
+      if (isJumpInstruction(instruction)) {
+        target = jumpTarget(chunk, read);
+      }
+      break;
+    }
+
+    if (target != -1) {
+      // offset filled once all instructions moved
+      jumps[jumpCount].offset = write;
+      jumps[jumpCount].target = target;
+      jumpCount++;
+      code[write] = fused;
+      chunk->lines[write] = chunk->lines[write + 1] = chunk->lines[write + 2] =
+          line;
+      write += 3;
+    } else if (fused != instruction) {
+      // `OP_CONSTANT` or `OP_SET_*`: keep the operands of the first one
+      int operands = instructionLength(chunk, read) - 1;
+      code[write] = fused;
+      chunk->lines[write] = line;
+      for (int i = 1; i <= operands; i++) {
+        code[write + i] = code[read + i];
+        chunk->lines[write + i] = line;
+      }
+      write += 1 + operands;
+    } else {
+      for (int i = 0; i < length; i++) {
+        code[write + i] = code[read + i];
+        chunk->lines[write + i] = chunk->lines[read + i];
+      }
+      write += length;
+    }
+    read += length;
+  }
+  newOffsets[count] = write;
+
+  for (int i = 0; i < jumpCount; i++) {
+    int offset = jumps[i].offset;
+    int target = newOffsets[jumps[i].target];
+    int jump = code[offset] == OP_LOOP ? offset + 3 - target
+                                       : target - (offset + 3);
+    code[offset + 1] = (jump >> 8) & 0xff;
+    code[offset + 2] = jump & 0xff;
+  }
+  chunk->count = write;
+
+  FREE_ARRAY(PendingJump, jumps, count);
+  FREE_ARRAY(int, newOffsets, count + 1);
+  FREE_ARRAY(bool, isTarget, count + 1);
+}
@@ -6,89 +6,316 @@
 #include "table.h"
 #include "value.h"
 
+// entries per index slot, at most: the index stays sparse
 #define TABLE_MAX_LOAD 0.75
+// the smallest index, with room for a single entry
+#define TABLE_MIN_CAPACITY 2
+
+// largest capacities whose index slots fit in 2 and 4 bytes: the entry
+// numbers take 8 and 24 bits of them, and 32 bits of the 8-byte ones
+#define INDEX16_CAPACITY 256
+#define INDEX32_CAPACITY (1 << 24)
+#define INDEX_EMPTY -1
 
 void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
+  table->entryCount = 0;
+  table->index = NULL;
   table->entries = NULL;
 }
 
+// length of the entries array
+static inline int usableEntries(int capacity) {
+  return capacity * TABLE_MAX_LOAD;
+}
+
+static inline size_t indexSize(int capacity) {
+  if (capacity <= INDEX16_CAPACITY) {
+    return capacity * sizeof(int16_t);
+  }
+  if (capacity <= INDEX32_CAPACITY) {
+    return capacity * sizeof(int32_t);
+  }
+  return capacity * sizeof(int64_t);
+}
+
+/**
+ * An index slot holds the number of an entry and, above it, the 8 high
+ * bits of its key hash: a probe only reads the entries whose "tag"
+ * matches. An empty slot has all its bits set, which no entry number has.
+ */
+static inline int entryBits(int capacity) {
+  if (capacity <= INDEX16_CAPACITY) {
+    return 8;
+  }
+  return capacity <= INDEX32_CAPACITY ? 24 : 32;
+}
+
+static inline uint8_t hashTag(uint32_t hash) {
+  return hash >> 24;
+}
+
+// the slots are read sign extended: an empty one is INDEX_EMPTY. With a
+// constant `size`, the probe loops are compiled for each slot size.
+static inline int64_t readSlot(void *index, int size, uint32_t slot) {
+  if (size == sizeof(int16_t)) {
+    return ((int16_t *)index)[slot];
+  }
+  if (size == sizeof(int32_t)) {
+    return ((int32_t *)index)[slot];
+  }
+  return ((int64_t *)index)[slot];
+}
+
+static inline int slotSize(int capacity) {
+  if (capacity <= INDEX16_CAPACITY) {
+    return sizeof(int16_t);
+  }
+  return capacity <= INDEX32_CAPACITY ? sizeof(int32_t) : sizeof(int64_t);
+}
+
+static inline int64_t getSlot(Table *table, uint32_t slot) {
+  return readSlot(table->index, slotSize(table->capacity), slot);
+}
+
+static inline void setSlot(Table *table, uint32_t slot, int64_t word) {
+  if (table->capacity <= INDEX16_CAPACITY) {
+    ((int16_t *)table->index)[slot] = word;
+  } else if (table->capacity <= INDEX32_CAPACITY) {
+    ((int32_t *)table->index)[slot] = word;
+  } else {
+    ((int64_t *)table->index)[slot] = word;
+  }
+}
+
+// the slot word of the entry `entry`
+static inline int64_t slotWord(Table *table, int entry) {
+  uint8_t tag = hashTag(table->entries[entry].key->hash);
+  return (int64_t)tag << entryBits(table->capacity) | entry;
+}
+
+// the entry indexed in `slot`, which isn't empty
+static inline Entry *slotEntry(Table *table, uint32_t slot) {
+  int64_t mask = ((int64_t)1 << entryBits(table->capacity)) - 1;
+  return &table->entries[getSlot(table, slot) & mask];
+}
+
 // free it content
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(Entry, table->entries, usableEntries(table->capacity));
+  FREE_ARRAY(uint8_t, table->index, indexSize(table->capacity));
   initTable(table);
 }
 
+// see `findSlot()`: each call is inlined, with its own slot `size`
+__attribute__((always_inline)) static inline int
+findSlotSized(Table *table, ObjString *key, int size, Entry **entry) {
+  // this is a faster way to do `key->hash % capacity`, it is valid as long
+  // as `capacity` is a power of 2
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = key->hash & mask;
+  int bits = size == sizeof(int16_t) ? 8 : size == sizeof(int32_t) ? 24 : 32;
+  uint8_t tag = hashTag(key->hash);
+  for (;;) {
+    int64_t word = readSlot(table->index, size, slot);
+    if (word == INDEX_EMPTY) {
+      return -1;
+    }
+    if ((uint8_t)(word >> bits) == tag) {
+      *entry = &table->entries[word & (((int64_t)1 << bits) - 1)];
+      if ((*entry)->key == key) {
+        return slot;
+      }
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
 /**
- * find entry in flat value array using key's hash.
- * (Implements linear probing)
- *
+ * Index slot of `key`, or -1, and its entry. Keys are compared by pointer,
+ * because strings are INTERNED. The index is NEVER FULL: an empty slot
+ * ends the probing.
  */
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  // this is a faster way to do `key->hash % capacity`, it is valid as long as
-  // `capacity` is a power of 2
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = NULL;
-  // looks for existing entry or empty slot,
-  // `findEntry()` assumes that the Table is NEVER FULL.
+__attribute__((always_inline)) static inline int
+findSlot(Table *table, ObjString *key, Entry **entry) {
+  if (table->capacity <= INDEX16_CAPACITY) {
+    return findSlotSized(table, key, sizeof(int16_t), entry);
+  }
+  if (table->capacity <= INDEX32_CAPACITY) {
+    return findSlotSized(table, key, sizeof(int32_t), entry);
+  }
+  return findSlotSized(table, key, sizeof(int64_t), entry);
+}
+
+// index slot of the entry `entry`. Only the entry numbers are compared:
+// the slots are read sign extended (see `readSlot()`), the tags aren't.
+static int findEntrySlot(Table *table, int entry) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = table->entries[entry].key->hash & mask;
+  int64_t entryMask = ((int64_t)1 << entryBits(table->capacity)) - 1;
+  while ((getSlot(table, slot) & entryMask) != entry) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// index the entry `entry`, whose key isn't in the index yet
+static void indexEntry(Table *table, int entry) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = table->entries[entry].key->hash & mask;
+  while (getSlot(table, slot) != INDEX_EMPTY) {
+    slot = (slot + 1) & mask;
+  }
+  setSlot(table, slot, slotWord(table, entry));
+}
+
+/**
+ * Empty the index slot `slot`. The next slots, up to an empty one, hold
+ * entries that may have probed through it: those whose home slot isn't
+ * after it move back there (Knuth's "algorithm R"), so that a lookup
+ * still stops at the first empty slot.
+ */
+static void unindexSlot(Table *table, uint32_t slot) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t next = slot;
   for (;;) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // if after following the chain, we encounter an empty
-        // entry, this means that the `key` is not yet in the table,
-        // we can return a "tombstone" which is also empty.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // we found a tombstone
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // equality works because strings are INTERNED,
-      // eg: two strings representing the same chars are pointed
-      // by the same pointer.
-      return entry;
+    next = (next + 1) & mask;
+    int64_t word = getSlot(table, next);
+    if (word == INDEX_EMPTY) {
+      break;
+    }
+    uint32_t home = slotEntry(table, next)->key->hash & mask;
+    // distances from `slot`: the entry can move there if its home isn't
+    // in (slot, next]
+    if (((home - slot - 1) & mask) >= ((next - slot) & mask)) {
+      setSlot(table, slot, word);
+      slot = next;
     }
-    // probe next entry, 'cause the one we found doesn't match our key.
-    // same as `index = (index + 1) % capacity`
-    index = (index + 1) & (capacity - 1);
   }
+  setSlot(table, slot, INDEX_EMPTY);
 }
 
+#ifdef CONCURRENT_GC
+// the entries of `table` are about to move: the background marker could
+// miss them (see `adjustCapacity()`), mark them first.
+static void shadeEntries(Table *table) {
+  for (int i = 0; i < table->entryCount; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      shadeObject((Obj *)entry->key);
+      deletionBarrier(entry->value);
+    }
+  }
+}
+#endif
+
+// copy the entries of `table` to `entries`, in the same order, without
+// the deleted ones: returns how many. They may be moved in place.
+static int compactEntries(Table *table, Entry *entries) {
+  int count = 0;
+  for (int i = 0; i < table->entryCount; i++) {
+    Entry *src = &table->entries[i];
+    if (src->key == NULL)
+      continue;
+    entries[count++] = *src;
+  }
+  return count;
+}
+
+/**
+ * Rebuild the table with an index of `capacity` slots: its entries are
+ * compacted, in the same order, without the deleted ones. They stay in
+ * the same array if the capacity doesn't change.
+ */
 static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
+  if (capacity == table->capacity) {
+#ifdef CONCURRENT_GC
+    // the string table is weak: it is not marked
+    if (vm.gcPhase == GC_CONCURRENT_MARK && table != &vm.strings) {
+      shadeEntries(table);
+    }
+#endif
+    int count = compactEntries(table, table->entries);
+    // a concurrent marker may still read up to the former `entryCount`
+    for (int i = count; i < table->entryCount; i++) {
+      table->entries[i].key = NULL;
+      table->entries[i].value = NIL_VAL;
+    }
+    table->count = count;
+    __atomic_store_n(&table->entryCount, count, __ATOMIC_RELEASE);
+    memset(table->index, 0xff, indexSize(capacity)); // INDEX_EMPTY
+    for (int i = 0; i < count; i++) {
+      indexEntry(table, i);
+    }
+    return;
+  }
+
+  Entry *entries = ALLOCATE(Entry, usableEntries(capacity));
+  void *index = ALLOCATE(uint8_t, indexSize(capacity));
   // basically memset(0)
-  for (int i = 0; i < capacity; i++) {
+  for (int i = 0; i < usableEntries(capacity); i++) {
     entries[i].key = NULL;
     entries[i].value = NIL_VAL;
   }
+  memset(index, 0xff, indexSize(capacity)); // INDEX_EMPTY
 
-  // re-build the whole HashMap
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *src = &table->entries[i];
-    if (src->key == NULL)
-      continue;
+  Table resized = {0, capacity, 0, index, entries};
+  resized.entryCount = compactEntries(table, entries);
+  for (int i = 0; i < resized.entryCount; i++) {
+    indexEntry(&resized, i);
+  }
 
-    Entry *dest = findEntry(entries, capacity, src->key);
-    dest->key = src->key;
-    dest->value = src->value;
-    table->count++;
+#ifdef CONCURRENT_GC
+  // the string table is weak: it is not marked
+  if (vm.gcPhase == GC_CONCURRENT_MARK && table != &vm.strings) {
+    shadeEntries(table);
   }
+#endif
 
-  // update table
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  // update table. A concurrent marker only reads the entries allowed by
+  // both the capacity and the entries it sees (see `markTable()`): the
+  // smaller one of them is stored first.
+  FREE_ARRAY(Entry, table->entries, usableEntries(table->capacity));
+  FREE_ARRAY(uint8_t, table->index, indexSize(table->capacity));
+  table->index = index;
+  table->count = resized.entryCount;
+  __atomic_store_n(&table->entryCount, resized.entryCount, __ATOMIC_RELEASE);
+  if (capacity > table->capacity) {
+    __atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->entries, entries, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Capacity of `table` once its full entries array is compacted. It grows
+ * if its entries would fill half of it, and shrinks if they would fill
+ * less than an eighth: in between, a compaction leaves room for more
+ * insertions than it moves entries.
+ */
+static int nextCapacity(Table *table) {
+  int capacity = table->capacity;
+  if (capacity == 0) {
+    return TABLE_MIN_CAPACITY;
+  }
+  if (2 * table->count >= usableEntries(capacity)) {
+    return capacity * 2;
+  }
+  while (capacity > TABLE_MIN_CAPACITY &&
+         table->count < usableEntries(capacity) / 8) {
+    capacity /= 2;
+  }
+  return capacity;
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0)
     return false;
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  Entry *entry;
+  if (findSlot(table, key, &entry) < 0) {
     return false;
   }
   *value = entry->value;
@@ -96,41 +323,54 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  Entry *entry;
+  if (table->count != 0 && findSlot(table, key, &entry) >= 0) {
+    deletionBarrier(entry->value);
+    entry->value = value;
+    return false;
   }
 
-  // findEntry() directly returns the bucket pointer
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) // IS_NIL() checks if its a tombstone
-    table->count++;
+  // no room after the last entry: compact them
+  if (table->entryCount == usableEntries(table->capacity)) {
+    adjustCapacity(table, nextCapacity(table));
+  }
+  entry = &table->entries[table->entryCount];
   entry->key = key;
   entry->value = value;
-  return isNewKey;
+  indexEntry(table, table->entryCount);
+  // a concurrent marker reads the entries up to there (see `markTable()`)
+  __atomic_store_n(&table->entryCount, table->entryCount + 1,
+                   __ATOMIC_RELEASE);
+  table->count++;
+  return true;
 }
+
+// delete `entry`, indexed in `slot`: it leaves a hole in the entries
+static void deleteSlot(Table *table, int slot, Entry *entry) {
+  unindexSlot(table, slot);
+  deletionBarrier(OBJ_VAL(entry->key));
+  deletionBarrier(entry->value);
+  entry->key = NULL;
+  entry->value = NIL_VAL;
+  table->count--;
+}
+
 bool tableDelete(Table *table, ObjString *key) {
   if (table->count == 0)
     return false;
-  Entry *del_entry = findEntry(table->entries, table->capacity, key);
-  if (del_entry->key == NULL)
+  Entry *entry;
+  int slot = findSlot(table, key, &entry);
+  if (slot < 0)
     return false;
-  // Empty the entry bucket by placing a special
-  // maker in it: a tombstone.
-  // tombones have a NULL key and a True value.
-  del_entry->key = NULL;
-  del_entry->value = BOOL_VAL(true);
-  // DO NOT table->count --; otherwise we might end up with an "empty"
-  // Table, full of tombstone
+  deleteSlot(table, slot, entry);
   return true;
 }
 
 /**
- * Copy hashmap values from `from` into `to`.
+ * Copy hashmap values from `from` into `to`, in insertion order.
  */
 void tableAddAll(Table *from, Table *to) {
-  for (int i = 0; i < from->capacity; i++) {
+  for (int i = 0; i < from->entryCount; i++) {
     Entry *src = &from->entries[i];
     if (src->key == NULL)
       continue;
@@ -138,46 +378,106 @@ void tableAddAll(Table *from, Table *to) {
   }
 }
 
+/**
+ * Replace the key `key` by `newKey`, a copy of it (same hash): used by the
+ * GC when it moves a string.
+ */
+void tableReplaceKey(Table *table, ObjString *key, ObjString *newKey) {
+  if (table->count == 0)
+    return;
+  Entry *entry;
+  if (findSlot(table, key, &entry) >= 0) {
+    entry->key = newKey;
+  }
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash) {
   if (table->count == 0)
     return NULL;
 
   // same as `index = hash % table->capacity`
-  uint32_t index = hash & (table->capacity - 1);
-  Entry *tombstone = NULL;
+  uint32_t mask = table->capacity - 1;
+  uint32_t slot = hash & mask;
+  int bits = entryBits(table->capacity);
+  uint8_t tag = hashTag(hash);
   for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // stop if we find an empty non-tombstone entry
-      if (IS_NIL(entry->value))
-        return NULL;
-
-    } else if ( // full comparaison
-        entry->key->length == length && entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+    int64_t word = getSlot(table, slot);
+    // stop if we find an empty slot
+    if (word == INDEX_EMPTY) {
+      return NULL;
     }
-    // probe next entry, 'cause the one we found doesn't match our key.
-    index = (index + 1) & (table->capacity - 1);
+    if ((uint8_t)(word >> bits) == tag) {
+      ObjString *key = table->entries[word & (((int64_t)1 << bits) - 1)].key;
+      if ( // full comparaison
+          key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+#ifdef CONCURRENT_GC
+        // the string table is weak: `key` may have been unreachable when
+        // marking started, it is reachable again
+        if (vm.gcPhase == GC_CONCURRENT_MARK) {
+          shadeObject((Obj *)key);
+        }
+#endif
+        return key;
+      }
+    }
+    slot = (slot + 1) & mask;
   }
 }
 
-// remove unreachable (marked "white") entries from the table
+// remove unreachable (marked "white") entries from the table. Young keys
+// are left to the next minor collection (see `sweepNursery()`).
 void tableRemoveWhite(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
+  for (int i = 0; i < table->entryCount; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (entry->key != NULL && !isMarked((Obj *)entry->key) &&
+        !isYoung((Obj *)entry->key)) {
+      deleteSlot(table, findEntrySlot(table, i), entry);
     }
   }
 }
 
 // mark both key and values of the Table
 void markTable(Table *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
+  // it may be resized meanwhile: read the entries that both sizes have
+  int capacity = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+  Entry *entries = __atomic_load_n(&table->entries, __ATOMIC_ACQUIRE);
+  int after = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+  int count = __atomic_load_n(&table->entryCount, __ATOMIC_ACQUIRE);
+  if (after < capacity) {
+    capacity = after;
+  }
+  if (count > usableEntries(capacity)) {
+    count = usableEntries(capacity);
+  }
+  for (int i = 0; i < count; i++) {
+    Entry *entry = &entries[i];
     markObject((Obj *)entry->key);
     markValue(entry->value);
   }
 }
+
+/**
+ * Add the entries of `table` to `stats`, with their probe lengths: the
+ * index slots a lookup reads to find them.
+ */
+void tableStats(Table *table, TableStats *stats) {
+  stats->tables++;
+  stats->entries += table->count;
+  stats->capacity += table->capacity;
+  stats->bytes += indexSize(table->capacity) +
+                  usableEntries(table->capacity) * sizeof(Entry);
+  uint32_t mask = table->capacity - 1;
+  for (int slot = 0; slot < table->capacity; slot++) {
+    if (getSlot(table, slot) == INDEX_EMPTY) {
+      continue;
+    }
+    uint32_t home = slotEntry(table, slot)->key->hash & mask;
+    int length = ((slot - home) & mask) + 1;
+    stats->probes += length;
+    if (length > stats->maxProbe) {
+      stats->maxProbe = length;
+    }
+  }
+}
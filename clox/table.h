@@ -9,20 +9,42 @@ typedef struct {
   Value value;
 } Entry;
 
+/**
+ * Hash map in two arrays, like CPython dicts: the entries, in insertion
+ * order, and a sparse index of them, with linear probing. An index slot
+ * takes 2, 4 or 8 bytes, depending on the capacity: small tables are
+ * small. It keeps some bits of the key hash, for probes to skip the
+ * entries of other keys. Deleted entries leave a hole until the entries
+ * are compacted, but no tombstone in the index.
+ */
 typedef struct {
-  int count; // entries + tombstones
-  int capacity;
-  Entry *entries;
+  int count;      // entries
+  int capacity;   // index slots, a power of 2
+  int entryCount; // used entries, deleted ones included
+  void *index;    // for each slot, an entry and its hash bits, or -1
+  Entry *entries; // the first `entryCount` are used, NULL keys are deleted
 } Table;
 
+// probe lengths of the entries of some tables (see `tableStats()`)
+typedef struct {
+  int tables;
+  long entries;
+  long capacity;
+  long bytes;  // of both arrays
+  long probes; // sum of the probe lengths
+  int maxProbe;
+} TableStats;
+
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
+void tableReplaceKey(Table *table, ObjString *key, ObjString *newKey);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
 void tableRemoveWhite(Table *table);
 void markTable(Table *table);
+void tableStats(Table *table, TableStats *stats);
 #endif
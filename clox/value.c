@@ -12,7 +12,11 @@ bool valuesEqual(Value a, Value b) {
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b) {
+    return true;
+  }
+  // literals are interned, strings built at runtime are not
+  return IS_OBJ(a) && IS_OBJ(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b));
 #else
   if (a.type != b.type)
     return false;
@@ -24,7 +28,7 @@ bool valuesEqual(Value a, Value b) {
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(AS_OBJ(a), AS_OBJ(b));
   default:
     return false;
   }
@@ -66,6 +70,8 @@ void printValue(Value value) {
     printf("%g", AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
   }
 
 #else
@@ -83,6 +89,9 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   }
 #endif
 }
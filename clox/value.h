@@ -34,10 +34,14 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1   // b01
 #define TAG_FALSE 2 // b10
 #define TAG_TRUE 3  // b11
+#define TAG_UNDEFINED 4 // b100, never seen by user code
+
 
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+// value of the global variable slots not defined yet
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 
 typedef uint64_t Value;
 
@@ -64,6 +68,7 @@ static inline double valueToNum(Value value) {
 // to a TRUE_VAL
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value)&QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
 
@@ -88,6 +93,7 @@ typedef enum {
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED, // global variable slots not defined yet
 } ValueType;
 
 // Type of values, those live
@@ -104,6 +110,7 @@ typedef struct {
 // Type checks
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -115,6 +122,7 @@ typedef struct {
 // C types to Values
 #define BOOL_VAL(b) ((Value){VAL_BOOL, {.boolean = b}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0.}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0.}})
 #define NUMBER_VAL(num) ((Value){VAL_NUMBER, {.number = num}})
 #define OBJ_VAL(object) ((Value){.type = VAL_OBJ, {.obj = (Obj *)object}})
 
@@ -126,6 +134,7 @@ typedef struct {
   Value *values;
 } ValueArray;
 
+// may flatten ropes: allocates, the caller keeps `a` and `b` reachable
 bool valuesEqual(Value a, Value b);
 
 void initValueArray(ValueArray *array);
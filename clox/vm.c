@@ -1,18 +1,100 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "vm.h"
 
+// "labels as values" is a GCC extension (clang supports it too),
+// other compilers fall back to the `switch` dispatch.
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+#define THREADED_DISPATCH
+#endif
+
 VM vm;
 
+// the instructions using inline caches (for stats)
+typedef enum {
+  CACHE_GET_PROPERTY,
+  CACHE_SET_PROPERTY,
+  CACHE_INVOKE,
+} CacheSite;
+
+#ifdef DEBUG_IC_STATS
+static long cacheHits[CACHE_INVOKE + 1];
+static long cacheMisses[CACHE_INVOKE + 1];
+#define COUNT_CACHE(counters, site) ((counters)[site]++)
+
+static void printInlineCacheStats(void) {
+  static const char *names[] = {
+      [CACHE_GET_PROPERTY] = "OP_GET_PROPERTY",
+      [CACHE_SET_PROPERTY] = "OP_SET_PROPERTY",
+      [CACHE_INVOKE] = "OP_INVOKE",
+  };
+  fprintf(stderr, "-- inline caches\n");
+  for (int site = 0; site <= CACHE_INVOKE; site++) {
+    long total = cacheHits[site] + cacheMisses[site];
+    fprintf(stderr, "   %-16s %10ld hits %10ld misses (%5.1f%% hit rate)\n",
+            names[site], cacheHits[site], cacheMisses[site],
+            total == 0 ? 0. : 100. * cacheHits[site] / total);
+  }
+}
+#else
+#define COUNT_CACHE(counters, site) ((void)(site))
+#endif
+
+#ifdef DEBUG_OPCODE_PAIRS
+static long opcodePairs[OP_COUNT][OP_COUNT];
+static uint8_t previousOpcode = OP_RETURN;
+// called right before executing the instruction at `ip`
+#define COUNT_OPCODE_PAIR(ip)                                                  \
+  do {                                                                         \
+    opcodePairs[previousOpcode][*(ip)]++;                                      \
+    previousOpcode = *(ip);                                                    \
+  } while (false)
+
+#define OPCODE_PAIRS_SHOWN 40
+
+static void printOpcodePairs(void) {
+  long total = 0;
+  for (int first = 0; first < OP_COUNT; first++) {
+    for (int second = 0; second < OP_COUNT; second++) {
+      total += opcodePairs[first][second];
+    }
+  }
+  fprintf(stderr, "-- opcode pairs (%ld instructions)\n", total);
+  // selection of the most frequent pairs, clearing them once printed.
+  for (int shown = 0; shown < OPCODE_PAIRS_SHOWN; shown++) {
+    int first = 0, second = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+      for (int j = 0; j < OP_COUNT; j++) {
+        if (opcodePairs[i][j] > opcodePairs[first][second]) {
+          first = i;
+          second = j;
+        }
+      }
+    }
+    long count = opcodePairs[first][second];
+    if (count == 0)
+      break;
+    fprintf(stderr, "   %-18s %-18s %12ld (%5.2f%%)\n", opcodeName(first),
+            opcodeName(second), count, 100. * count / total);
+    opcodePairs[first][second] = 0;
+  }
+}
+#else
+#define COUNT_OPCODE_PAIR(ip) ((void)0)
+#endif
+
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
@@ -23,6 +105,9 @@ static void resetStack() {
   vm.openUpvalues = NULL;
 }
 
+// frames printed at each end of the stack trace of a runtime error
+#define TRACE_FRAMES 16
+
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -31,12 +116,25 @@ static void runtimeError(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
+  // relies on run() having stored its cached `ip` into the topmost frame.
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    // deep recursions: only the innermost and outermost frames
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+      fprintf(stderr, "[...] %d more frames\n", i + 1 - TRACE_FRAMES);
+      i = TRACE_FRAMES;
+      continue;
+    }
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code -
-                         1; // code point to the next instruction
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    uint8_t *code = function->chunk.code;
+    int *lines = function->chunk.lines;
+    if (vm.backend == BACKEND_REGISTER) {
+      code = function->chunk.registers.code;
+      lines = function->chunk.registers.lines;
+    }
+    size_t instruction = frame->ip - code - 1; // code point to the next
+                                               // instruction
+    fprintf(stderr, "[line %d] in ", lines[instruction]);
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -48,28 +146,87 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
+/**
+ * Returns the index of the global variable `name` in `vm.globalValues`,
+ * allocate an (undefined) slot the first time `name` is seen.
+ * Slots are never reused, so the compiler can emit their index.
+ */
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+  push(OBJ_VAL(name)); // so GC can see it while growing the arrays
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
 static void defineNative(const char *name, NativeFn function) {
   // push/pop to ensure the GC preserves it.
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
 void initVM() {
+  vm.frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
+  vm.stackHighWater = 0;
+  if (vm.frames == NULL || vm.stack == NULL) {
+    exit(1);
+  }
   resetStack();
-  vm.objects = NULL;
+  vm.pages = NULL;
+  for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+    vm.freePages[i] = NULL;
+    vm.sweepPages[i] = NULL;
+  }
+  vm.nursery = malloc(NURSERY_SIZE);
+  if (vm.nursery == NULL) {
+    exit(1);
+  }
+  vm.nurseryTop = vm.nursery;
+  vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+  vm.nurseryFull = false;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
 
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.gcSliceBudget = 0;
+  vm.gcConcurrent = false;
+  vm.gcThreads = 1;
+  vm.gcCompact = 0;
+  vm.gcCompactPending = false;
+  vm.gcPhase = GC_IDLE;
+  vm.gcEpoch = 0;
+  vm.gcNextSlice = 0;
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
+  vm.gcStats = (GCStats){0};
+  vm.showGCStats = false;
+  vm.showTableStats = false;
 
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.strings);
 
+  vm.backend = BACKEND_STACK;
+  vm.jit = true;
+  vm.jitDepth = 0;
+
   vm.initString = NULL; // copyString might trigger GC, which reads 'initString'
   vm.initString = copyString("init", 4);
 
@@ -78,16 +235,35 @@ void initVM() {
 }
 
 void freeVM() {
+#ifdef DEBUG_IC_STATS
+  printInlineCacheStats();
+#endif
+#ifdef DEBUG_OPCODE_PAIRS
+  printOpcodePairs();
+#endif
+  if (vm.showGCStats) {
+    printGCStats();
+  }
+  if (vm.showTableStats) {
+    printTableStats();
+  }
   // free all remaining heap objects
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.strings);
   vm.initString = NULL;
   freeObjects();
+  free(vm.stack);
+  free(vm.frames);
 }
 
 void push(Value value) {
   *vm.stackTop = value;
   vm.stackTop++;
+  if (vm.stackTop - vm.stack > vm.stackHighWater) {
+    vm.stackHighWater = (int)(vm.stackTop - vm.stack);
+  }
 }
 
 Value pop() {
@@ -97,8 +273,68 @@ Value pop() {
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+/**
+ * Grow the stack so that it holds at least `count` values.
+ * It moves: the pointers into it (stack top, frames slots, open upvalues)
+ * are rebased. Returns false past `STACK_MAX`.
+ */
+static bool growStack(int count) {
+  if (count > STACK_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+  int capacity = vm.stackCapacity * 2;
+  if (capacity < count) {
+    capacity = count;
+  } else if (capacity > STACK_MAX) {
+    capacity = STACK_MAX;
+  }
+  // not through `reallocate()`: it would run the GC in the middle of a
+  // call. The stack isn't a heap object anyway.
+  Value *stack = realloc(vm.stack, sizeof(Value) * capacity);
+  if (stack == NULL) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+  return true;
+}
+
+// Double the room for frames. Returns false past `FRAMES_MAX`.
+static bool growFrames(void) {
+  if (vm.frameCapacity == FRAMES_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+  int capacity = vm.frameCapacity * 2;
+  if (capacity > FRAMES_MAX) {
+    capacity = FRAMES_MAX;
+  }
+  CallFrame *frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+  return true;
+}
+
 /**
  * Mutate the global `vm` state to change current stackframe and ip.
+ *
+ * The whole stack the frame may use (`stackSize`) is reserved here, so
+ * the instructions push without checking for overflow. Both the stack and
+ * the frames may move: callers reload their pointers into them.
  */
 static bool call(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
@@ -106,9 +342,19 @@ static bool call(ObjClosure *closure, int argCount) {
                  argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  if (vm.frameCount == vm.frameCapacity && !growFrames()) {
+    return false;
+  }
+  int stackEnd =
+      (int)(vm.stackTop - argCount - 1 - vm.stack) + closure->function->stackSize;
+  if (stackEnd > vm.stackCapacity && !growStack(stackEnd)) {
+    return false;
+  }
+#ifdef JIT
+  if (closure->function->hotness < JIT_THRESHOLD) {
+    closure->function->hotness++;
   }
+#endif
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
@@ -164,6 +410,126 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
+/**
+ * Remember that, for instances of shape `shape`, the property looked up by
+ * this site is either the field stored at index `field` of the instances'
+ * `fields`, or the class method `method` (if `field` is -1).
+ * `transition` is only set by sites adding the field `field` to `shape`.
+ * `cache` belongs to the chunk of `function`.
+ *
+ * Fill the way already used by `shape` or the first free one. If none
+ * is available, the site is megamorphic: leave the cache untouched.
+ */
+static void fillCache(ObjFunction *function, InlineCache *cache,
+                      ObjShape *shape, int field, ObjClosure *method,
+                      ObjShape *transition) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    InlineCacheWay *way = &cache->ways[i];
+    if (way->shape == NULL || way->shape == shape) {
+      deletionBarrier(OBJ_VAL(way->shape));
+      deletionBarrier(OBJ_VAL(way->method));
+      deletionBarrier(OBJ_VAL(way->transition));
+      writeBarrier((Obj *)function, OBJ_VAL(shape));
+      writeBarrier((Obj *)function, OBJ_VAL(method));
+      writeBarrier((Obj *)function, OBJ_VAL(transition));
+      way->shape = shape;
+      way->version = shape->klass->version;
+      way->field = field;
+      way->method = method;
+      way->transition = transition;
+      return;
+    }
+  }
+}
+
+/**
+ * Resolve the property `name` of `instance`, using (and updating) the
+ * call site `cache`, of the chunk of `function`.
+ *
+ * Returns the slot of `instance` holding `name` if it is a field, and
+ * sets `*method` to NULL. Otherwise returns NULL and sets `*method` to
+ * the class method named `name` (or to NULL if there is none).
+ */
+static inline Value *lookupProperty(ObjFunction *function,
+                                    InlineCache *cache, ObjInstance *instance,
+                                    ObjString *name, ObjClosure **method,
+                                    CacheSite site) {
+  ObjShape *shape = instance->shape;
+
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    InlineCacheWay *way = &cache->ways[i];
+    if (way->shape != shape) {
+      if (way->shape == NULL)
+        break;
+      continue;
+    }
+    // the shape alone tells where a field is, and that no field shadows
+    // the cached method. Only the methods of the class can change.
+    if (way->field >= 0 && way->transition == NULL) {
+      COUNT_CACHE(cacheHits, site);
+      *method = NULL;
+      return &instance->fields[way->field];
+    }
+    if (way->field == -1 && way->version == shape->klass->version) {
+      COUNT_CACHE(cacheHits, site);
+      *method = way->method;
+      return NULL;
+    }
+    break;
+  }
+
+  // slow path: full lookup, then remember its result
+  COUNT_CACHE(cacheMisses, site);
+  *method = NULL;
+  int field = shapeFieldIndex(shape, name);
+  Value value;
+  if (field != -1) {
+    fillCache(function, cache, shape, field, NULL, NULL);
+    return &instance->fields[field];
+  }
+  if (tableGet(&shape->klass->methods, name, &value)) {
+    *method = AS_CLOSURE(value);
+    fillCache(function, cache, shape, -1, *method, NULL);
+  }
+  return NULL;
+}
+
+/**
+ * Store `value` in the field `name` of `instance`, if the site `cache`
+ * knows where it goes. Returns false (and does nothing) otherwise.
+ * Never allocates.
+ */
+static inline bool cachedSetField(InlineCache *cache, ObjInstance *instance,
+                                  Value value) {
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    InlineCacheWay *way = &cache->ways[i];
+    if (way->shape == instance->shape) {
+      if (way->field < 0)
+        return false;
+      if (way->transition != NULL) {
+        // adding the field: only if it fits in the current storage
+        if (way->field >= instance->capacity)
+          return false;
+        // the field first, then the shape naming it (see
+        // `instanceSetField()`)
+        writeBarrier((Obj *)instance, value);
+        instance->fields[way->field] = value;
+        writeBarrier((Obj *)instance, OBJ_VAL(way->transition));
+        deletionBarrier(OBJ_VAL(instance->shape));
+        __atomic_store_n(&instance->shape, way->transition, __ATOMIC_RELEASE);
+        return true;
+      }
+      deletionBarrier(instance->fields[way->field]);
+      writeBarrier((Obj *)instance, value);
+      instance->fields[way->field] = value;
+      return true;
+    }
+    if (way->shape == NULL)
+      return false;
+  }
+  return false;
+}
+
 /*
  * Lookup method from a class and call it
  * expect the stack to contain:
@@ -184,14 +550,16 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
 }
 
 /*
- * Execute an instance's method call,
+ * Execute an instance's method call (`cache` belongs to the chunk of
+ * `function`, the caller),
  * expect the stack to contain:
  * < args N>
  * ...
  * < args 0>
  * < object instance as value >
  */
-static bool invoke(ObjString *method, int argCount) {
+static bool invoke(ObjFunction *function, InlineCache *cache, ObjString *name,
+                   int argCount) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -201,14 +569,21 @@ static bool invoke(ObjString *method, int argCount) {
 
   ObjInstance *instance = AS_INSTANCE(receiver);
 
-  // handle cases where `method` isn't a class method but
+  // handle cases where `name` isn't a class method but
   // a field value (even if callable)
-  Value value;
-  if (tableGet(&instance->fields, method, &value)) {
+  ObjClosure *method;
+  Value *field =
+      lookupProperty(function, cache, instance, name, &method, CACHE_INVOKE);
+  if (field != NULL) {
+    Value value = *field;
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
-  return invokeFromClass(instance->klass, method, argCount);
+  if (method == NULL) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  return call(method, argCount);
 }
 
 /**
@@ -263,6 +638,7 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    writeBarrier((Obj *)upvalue, *upvalue->location);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
     vm.openUpvalues = upvalue->next;
@@ -276,246 +652,604 @@ static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  writeBarrier((Obj *)klass, OBJ_VAL(name));
+  writeBarrier((Obj *)klass, method);
+  klass->version++; // invalidate the inline caches
   pop();
 }
 
+/**
+ * Drop the topmost frame, before a tail call: the callee and its
+ * `argCount` arguments, on top of the stack, slide down to the slots of
+ * the frame. The call then reuses the frame, and returns straight to the
+ * caller. Natives (and classes without initializer) return right away,
+ * as the frame would have.
+ */
+static void dropFrame(int argCount) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // the locals are about to be overwritten
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          (argCount + 1) * sizeof(Value));
+  vm.stackTop = frame->slots + argCount + 1;
+  vm.frameCount--;
+}
+
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-// Concatenate 2 strings
+// Concatenate the 2 strings on top of the stack
 static void concatenate() {
-  ObjString *b = AS_STRING(peek(0)); // keep them on stack for GC
-  ObjString *a = AS_STRING(peek(1));
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  ObjString *result = takeString(chars, length);
+  Obj *b = AS_OBJ(peek(0)); // keep them on stack for GC
+  Obj *a = AS_OBJ(peek(1));
+  Obj *result = concatenateStrings(a, b);
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-  // fetch current frame, IP, locals offsets are all relative to it.
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+#ifdef DEBUG_TRACE_EXECUTION
+// print the stack content and the instruction about to be executed.
+static void traceExecution(CallFrame *frame) {
+  // print stack
+  printf("           ");
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[");
+    printValue(*slot);
+    printf("]");
+  }
+  printf("\n");
+  // print instruction
+  disassembleInstruction(
+      &frame->closure->function->chunk,
+      (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
+#ifdef JIT
+/**
+ * Whether the function of `frame` runs as machine code: compiles it once
+ * it is hot enough. A function the JIT can't compile stays interpreted.
+ * The frame must be stored, compiling allocates.
+ */
+static bool jitShouldEnter(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  // each machine code call nests in the C stack (unlike the interpreter)
+  if (vm.jitDepth >= JIT_MAX_DEPTH)
+    return false;
+  if (function->jitCode != NULL)
+    return true;
+  if (function->hotness < JIT_THRESHOLD)
+    return false;
+  if (jitCompile(function))
+    return true;
+  function->hotness = INT_MIN; // don't try again
+  return false;
+}
+#endif
+
+#if defined(THREADED_DISPATCH) && !defined(__clang__)
+// otherwise GCC "cross-jumps" all the `goto *` into a handful of shared
+// ones, which brings back the single mispredicted branch of the `switch`.
+__attribute__((optimize("no-crossjumping")))
+#endif
+/**
+ * Execute the frames above `baseFrame`, returns once they all returned.
+ * Frames whose function is (or becomes) hot enough are handed over to
+ * the JIT, at their current instruction.
+ */
+static InterpretResult run(int baseFrame) {
+  // The hot interpreter state lives in locals, so the C compiler can keep
+  // it in registers: `frame->ip`, `vm.stackTop` or `frame->slots` are
+  // memory that any store might alias. They are written back to the
+  // frame/vm (STORE_FRAME) before anything that may read them:
+  // calls, returns, allocations (GC root scanning) and runtime errors.
+  CallFrame *frame;
+  uint8_t *ip;      // mirror of `frame->ip`
+  Value *stackTop;  // mirror of `vm.stackTop`
+  Value *slots;     // mirror of `frame->slots`
+  Value *constants; // constant pool of the current chunk
+  InlineCache *caches; // inline caches of the current chunk
+
+// write the cached state back into the VM
+#define STORE_FRAME()                                                          \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm.stackTop = stackTop;                                                    \
+  } while (false)
+// (re)load the cached state from the topmost frame,
+// after a call or a return changed it.
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+    caches = frame->closure->function->chunk.caches;                           \
+    stackTop = vm.stackTop;                                                    \
+  } while (false)
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
 // dereference IP and execute it.
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() ((uint16_t)((*frame->ip++ << 8) | *frame->ip++))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-// `valueType` is itself a macro that build a specific type of `ValueType`
-#define BINARY_OP(valueType, op)                                               \
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define GLOBAL_NAME(slot) (AS_STRING(vm.globalNames.values[slot])->chars)
+#define RUNTIME_ERROR(...)                                                     \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers");                                \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+// rewrite the instruction being executed into `op`
+#define QUICKEN(op) (ip[-1] = (op))
+// `valueType` is itself a macro that build a specific type of `ValueType`.
+// Once the operands are known to be numbers, the instruction is quickened
+// into `quickOp`, which skips (most of) the type checks.
+#define BINARY_OP(valueType, op, quickOp)                                      \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers");                               \
+    }                                                                          \
+    QUICKEN(quickOp);                                                          \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(valueType(a op b));                                                   \
+  } while (false)
+// Quickened `BINARY_OP`: when an operand isn't a number, the instruction is
+// rewritten back into `genericOp`, and `ip` rewinded so that the following
+// `DISPATCH()` executes it (and reports the error if needed).
+#define BINARY_OP_NUM(valueType, op, genericOp)                                \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      QUICKEN(genericOp);                                                      \
+      ip--;                                                                    \
+    } else {                                                                   \
+      double b = AS_NUMBER(stackTop[-1]);                                      \
+      double a = AS_NUMBER(stackTop[-2]);                                      \
+      stackTop[-2] = valueType(a op b);                                        \
+      stackTop--;                                                              \
+    }                                                                          \
+  } while (false)
+// compare the 2 numbers on top of the stack, pop them, and jump
+// if the comparison is false.
+#define COMPARE_JUMP(op)                                                       \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers");                               \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    double b = AS_NUMBER(stackTop[-1]);                                        \
+    double a = AS_NUMBER(stackTop[-2]);                                        \
+    stackTop -= 2;                                                             \
+    if (!(a op b))                                                             \
+      ip += offset;                                                            \
   } while (false)
 
-  for (;;) {
+// debug hooks, run before each instruction
 #ifdef DEBUG_TRACE_EXECUTION
-    // print stack
-    printf("           ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[");
-      printValue(*slot);
-      printf("]");
-    }
-    printf("\n");
-    // print instruction
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    COUNT_OPCODE_PAIR(ip);                                                     \
+    STORE_FRAME();                                                             \
+    traceExecution(frame);                                                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() COUNT_OPCODE_PAIR(ip)
+#endif
+
+// hand the topmost frame over to the machine code, once it is hot.
+// Then again for the frame it returned (or tail called) to.
+#ifdef JIT
+#define JIT_ENTER()                                                            \
+  while (vm.jit && (frame->closure->function->jitCode != NULL ||               \
+                    frame->closure->function->hotness >= JIT_THRESHOLD)) {     \
+    STORE_FRAME();                                                             \
+    if (!jitShouldEnter(frame))                                                \
+      break;                                                                   \
+    if (jitEnter(frame) != INTERPRET_OK)                                       \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (vm.frameCount == baseFrame)                                            \
+      return INTERPRET_OK;                                                     \
+    LOAD_FRAME();                                                              \
+  }
+#else
+#define JIT_ENTER() ((void)0)
+#endif
+
+// collect the nursery once it is full. Only at backward jumps, returns
+// and tail calls: the minor collection moves objects, every reference
+// must be in the roots (see memory.c).
+#define SAFEPOINT()                                                            \
+  do {                                                                         \
+    if (vm.nurseryFull) {                                                      \
+      STORE_FRAME();                                                           \
+      collectNursery();                                                        \
+      LOAD_FRAME();                                                            \
+    }                                                                          \
+  } while (false)
+
+#ifdef THREADED_DISPATCH
+  // one label address per opcode, indexed by the opcode value.
+  // Each handler jumps directly to the next one, so every handler gets
+  // its own indirect branch (and its own branch prediction slot),
+  // instead of sharing the single one of the `switch`.
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+      [OP_NIL] = &&TARGET_OP_NIL,
+      [OP_TRUE] = &&TARGET_OP_TRUE,
+      [OP_FALSE] = &&TARGET_OP_FALSE,
+      [OP_POP] = &&TARGET_OP_POP,
+      [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+      [OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+      [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+      [OP_EQUAL] = &&TARGET_OP_EQUAL,
+      [OP_GREATER] = &&TARGET_OP_GREATER,
+      [OP_LESS] = &&TARGET_OP_LESS,
+      [OP_ADD] = &&TARGET_OP_ADD,
+      [OP_SUBSTRACT] = &&TARGET_OP_SUBSTRACT,
+      [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+      [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+      [OP_NOT] = &&TARGET_OP_NOT,
+      [OP_NEGATE] = &&TARGET_OP_NEGATE,
+      [OP_PRINT] = &&TARGET_OP_PRINT,
+      [OP_JUMP] = &&TARGET_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&TARGET_OP_LOOP,
+      [OP_CALL] = &&TARGET_OP_CALL,
+      [OP_INVOKE] = &&TARGET_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+      [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+      [OP_TAIL_INVOKE] = &&TARGET_OP_TAIL_INVOKE,
+      [OP_TAIL_SUPER_INVOKE] = &&TARGET_OP_TAIL_SUPER_INVOKE,
+      [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&TARGET_OP_RETURN,
+      [OP_CLASS] = &&TARGET_OP_CLASS,
+      [OP_INHERIT] = &&TARGET_OP_INHERIT,
+      [OP_METHOD] = &&TARGET_OP_METHOD,
+      [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+      [OP_ADD_STR] = &&TARGET_OP_ADD_STR,
+      [OP_SUBSTRACT_NUM] = &&TARGET_OP_SUBSTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&TARGET_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&TARGET_OP_DIVIDE_NUM,
+      [OP_GREATER_NUM] = &&TARGET_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&TARGET_OP_LESS_NUM,
+      [OP_POP_JUMP_IF_FALSE] = &&TARGET_OP_POP_JUMP_IF_FALSE,
+      [OP_POP_JUMP_IF_TRUE] = &&TARGET_OP_POP_JUMP_IF_TRUE,
+      [OP_JUMP_IF_NOT_LESS] = &&TARGET_OP_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_GREATER] = &&TARGET_OP_JUMP_IF_NOT_GREATER,
+      [OP_ADD_CONSTANT] = &&TARGET_OP_ADD_CONSTANT,
+      [OP_SUBSTRACT_CONSTANT] = &&TARGET_OP_SUBSTRACT_CONSTANT,
+      [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+      [OP_SET_GLOBAL_POP] = &&TARGET_OP_SET_GLOBAL_POP,
+  };
+#define TARGET(op)                                                             \
+  TARGET_##op:                                                                 \
+  case op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    goto *dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+#else
+#define TARGET(op) case op:
+#define DISPATCH() break
 #endif
-    uint8_t instruction;
-    // dispatch loop
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
+
+  LOAD_FRAME();
+  for (;;) {
+    // only reached once in threaded mode: each handler then jumps to the
+    // next one by itself.
+    TRACE_INSTRUCTION();
+    switch (READ_BYTE()) {
+    TARGET(OP_CONSTANT) {
       Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
+    TARGET(OP_NIL)
+      PUSH(NIL_VAL);
+      DISPATCH();
+    TARGET(OP_FALSE)
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    TARGET(OP_POP)
+      (void)POP();
+      DISPATCH();
+    TARGET(OP_GET_LOCAL) {
       // next op code is slot index.
       // read var slot index in the stack
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    TARGET(OP_SET_LOCAL) {
       // copy stack top to local slot,
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    TARGET(OP_GET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    TARGET(OP_DEFINE_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      vm.globalValues.values[slot] = POP();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    TARGET(OP_SET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value *global = &vm.globalValues.values[slot];
+      // assigning doesn't define a variable
+      if (IS_UNDEFINED(*global)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      break;
+      *global = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    TARGET(OP_GET_UPVALUE) {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+    TARGET(OP_SET_UPVALUE) {
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      deletionBarrier(*upvalue->location);
+      writeBarrier((Obj *)upvalue, PEEK(0));
+      *upvalue->location = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtimeError("Only instances haves properties.");
-        return INTERPRET_RUNTIME_ERROR;
+    TARGET(OP_GET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances haves properties.");
       }
       // read class instance (without poping it for GC)
-      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
       // read field/method name
       ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
 
       // If a field exists with this name, return it
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop(); // instance
-        push(value);
-        break;
+      ObjClosure *method;
+      Value *field = lookupProperty(frame->closure->function, cache, instance,
+                                    name, &method, CACHE_GET_PROPERTY);
+      if (field != NULL) {
+        stackTop[-1] = *field; // replace instance
+        DISPATCH();
       }
 
       // otherwise, it should be a method,
       // so bind it to the class instance and return it
-      if (!bindMethod(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      if (method == NULL) {
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
       }
-      break;
+      STORE_FRAME(); // allocates
+      ObjBoundMethod *bound = newBoundMethod(PEEK(0), method);
+      stackTop[-1] = OBJ_VAL(bound); // replace instance
+      DISPATCH();
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("Only instances haves properties.");
-        return INTERPRET_RUNTIME_ERROR;
+    TARGET(OP_SET_PROPERTY) {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances haves properties.");
       }
       // read class instance (without poping it for GC)
-      ObjInstance *instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop(); // instance
+      ObjInstance *instance = AS_INSTANCE(PEEK(1));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      if (cachedSetField(cache, instance, PEEK(0))) {
+        COUNT_CACHE(cacheHits, CACHE_SET_PROPERTY);
+      } else {
+        COUNT_CACHE(cacheMisses, CACHE_SET_PROPERTY);
+        ObjShape *shape = instance->shape;
+        STORE_FRAME(); // instanceSetField() might trigger the GC
+        instanceSetField(instance, name, PEEK(0));
+        // either an existing field, or the transition adding it: next
+        // instances of the same shape take the same path.
+        if (instance->shape == shape) {
+          fillCache(frame->closure->function, cache, shape,
+                    shapeFieldIndex(shape, name), NULL, NULL);
+        } else {
+          fillCache(frame->closure->function, cache, shape,
+                    instance->shape->fieldCount - 1, NULL, instance->shape);
+        }
+      }
+      Value value = POP();
+      (void)POP(); // instance
       // setters evaluate to the set value, so we push the value back
       // onto the stack
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_GET_SUPER: {
+    TARGET(OP_GET_SUPER) {
       ObjString *name = READ_STRING();
-      ObjClass *superClass = AS_CLASS(pop());
+      ObjClass *superClass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!bindMethod(superClass, name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      stackTop = vm.stackTop;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    TARGET(OP_EQUAL) {
+      // may flatten ropes (allocates): the operands stay on the stack
+      STORE_FRAME();
+      bool equal = valuesEqual(PEEK(1), PEEK(0));
+      stackTop -= 2;
+      PUSH(BOOL_VAL(equal));
+      DISPATCH();
     }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    TARGET(OP_GREATER)
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      DISPATCH();
+    TARGET(OP_LESS)
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      DISPATCH();
+    TARGET(OP_TRUE)
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    TARGET(OP_ADD)
+      if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+        QUICKEN(OP_ADD_STR);
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        stackTop = vm.stackTop;
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_ADD_NUM);
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
       } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      break;
-    case OP_SUBSTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE: {
+      DISPATCH();
+    TARGET(OP_SUBSTRACT)
+      BINARY_OP(NUMBER_VAL, -, OP_SUBSTRACT_NUM);
+      DISPATCH();
+    TARGET(OP_MULTIPLY)
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      DISPATCH();
+    TARGET(OP_DIVIDE)
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      DISPATCH();
+    TARGET(OP_ADD_NUM)
+      BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    TARGET(OP_ADD_STR)
+      if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+        STORE_FRAME();
+        concatenate();
+        stackTop = vm.stackTop;
+      } else {
+        QUICKEN(OP_ADD);
+        ip--;
+      }
+      DISPATCH();
+    TARGET(OP_SUBSTRACT_NUM)
+      BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBSTRACT);
+      DISPATCH();
+    TARGET(OP_MULTIPLY_NUM)
+      BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
+    TARGET(OP_DIVIDE_NUM)
+      BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    TARGET(OP_GREATER_NUM)
+      BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    TARGET(OP_LESS_NUM)
+      BINARY_OP_NUM(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    TARGET(OP_POP_JUMP_IF_FALSE) {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(POP()))
+        ip += offset;
+      DISPATCH();
+    }
+    TARGET(OP_POP_JUMP_IF_TRUE) {
+      uint16_t offset = READ_SHORT();
+      if (!isFalsey(POP()))
+        ip += offset;
+      DISPATCH();
+    }
+    TARGET(OP_JUMP_IF_NOT_LESS)
+      COMPARE_JUMP(<);
+      DISPATCH();
+    TARGET(OP_JUMP_IF_NOT_GREATER)
+      COMPARE_JUMP(>);
+      DISPATCH();
+    TARGET(OP_ADD_CONSTANT) {
+      // the constant is always a number
+      Value constant = READ_CONSTANT();
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      stackTop[-1] = NUMBER_VAL(AS_NUMBER(stackTop[-1]) + AS_NUMBER(constant));
+      DISPATCH();
+    }
+    TARGET(OP_SUBSTRACT_CONSTANT) {
+      Value constant = READ_CONSTANT();
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operands must be numbers");
+      }
+      stackTop[-1] = NUMBER_VAL(AS_NUMBER(stackTop[-1]) - AS_NUMBER(constant));
+      DISPATCH();
+    }
+    TARGET(OP_SET_LOCAL_POP) {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    TARGET(OP_SET_GLOBAL_POP) {
+      uint16_t slot = READ_SHORT();
+      Value *global = &vm.globalValues.values[slot];
+      if (IS_UNDEFINED(*global)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      *global = POP();
+      DISPATCH();
+    }
+    TARGET(OP_NOT)
+      // in place: `PUSH(f(POP()))` would modify `stackTop` twice
+      // in the same expression.
+      stackTop[-1] = BOOL_VAL(isFalsey(stackTop[-1]));
+      DISPATCH();
+    TARGET(OP_NEGATE) {
       // Check value type before
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
+      stackTop[-1] = NUMBER_VAL(-AS_NUMBER(stackTop[-1]));
+      DISPATCH();
     }
-    case OP_PRINT: {
-      printValue(pop());
+    TARGET(OP_PRINT) {
+      printValue(POP());
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_JUMP: {
-      frame->ip += READ_SHORT();
-      break;
+    TARGET(OP_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
+    TARGET(OP_JUMP_IF_FALSE) {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0))) {
-        frame->ip += offset;
+      if (isFalsey(PEEK(0))) {
+        ip += offset;
       }
-      break;
+      DISPATCH();
     }
-    case OP_LOOP: {
-      frame->ip -= READ_SHORT();
-      break;
+    TARGET(OP_LOOP) {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+#ifdef JIT
+      if (frame->closure->function->hotness < JIT_THRESHOLD) {
+        frame->closure->function->hotness++;
+      }
+#endif
+      SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_CALL: {
+    TARGET(OP_CALL) {
       // Expect on the stack:
       // * Number of arguments (top)
       // * ARGN N
@@ -523,14 +1257,16 @@ static InterpretResult run() {
       // * ARG 0
       // * function obj
       int argCount = READ_BYTE();
+      STORE_FRAME();
       // change stack frame
-      if (!callValue(peek(argCount), argCount)) {
+      if (!callValue(PEEK(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_INVOKE: {
+    TARGET(OP_INVOKE) {
       // Expected in the code:
       // * the slot id of the method name
       // * number of arguments
@@ -541,15 +1277,18 @@ static InterpretResult run() {
       // * ARGN N
       ObjString *method = READ_STRING();
       int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      STORE_FRAME();
       // change stack frame
-      if (!invoke(method, argCount)) {
+      if (!invoke(frame->closure->function, cache, method, argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       // restore stack frame
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE: {
+    TARGET(OP_SUPER_INVOKE) {
       // Expected in the code:
       // * the slot id of the method name
       // * number of arguments
@@ -561,19 +1300,68 @@ static InterpretResult run() {
       // * super class
       ObjString *method = READ_STRING();
       int argCount = READ_BYTE();
-      ObjClass *superClass = AS_CLASS(pop());
+      ObjClass *superClass = AS_CLASS(POP());
+      STORE_FRAME();
       // change stack frame
       if (!invokeFromClass(superClass, method, argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       // restore stack frame
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    TARGET(OP_TAIL_CALL) {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      dropFrame(argCount);
+      if (!callValue(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // a native already returned
+      if (vm.frameCount == baseFrame)
+        return INTERPRET_OK;
+      LOAD_FRAME();
+      SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    TARGET(OP_TAIL_INVOKE) {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      ObjFunction *function = frame->closure->function; // owns `cache`
+      STORE_FRAME();
+      dropFrame(argCount);
+      if (!invoke(function, cache, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (vm.frameCount == baseFrame)
+        return INTERPRET_OK;
+      LOAD_FRAME();
+      SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    TARGET(OP_TAIL_SUPER_INVOKE) {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superClass = AS_CLASS(POP());
+      STORE_FRAME();
+      dropFrame(argCount);
+      if (!invokeFromClass(superClass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    TARGET(OP_CLOSURE) {
       // pop constant (function) and re-push, wrap it inside closure
       // and push it back as a closure object.
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME(); // allocates
       ObjClosure *closure = newClosure(function);
       push(OBJ_VAL(closure));
       // create upvalue (eg: outer scope refs) bindings
@@ -584,67 +1372,963 @@ static InterpretResult run() {
           // here "frame" belong to the function in which the closure
           // as been declared, eg the direct parent of the closure,
           // in this context isLocal means that the upvalue is local to "frame".
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
+          closure->upvalues[i] = captureUpvalue(slots + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        // the closure may have been marked while capturing
+        writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
       }
-      break;
+      stackTop = vm.stackTop;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE: {
+    TARGET(OP_CLOSE_UPVALUE) {
       // copy stack local to heap, and
       // update the one reference to it
       // in the "upvalue" list.
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
+      closeUpvalues(stackTop - 1);
+      (void)POP();
+      DISPATCH();
     }
-    case OP_RETURN: {
-      Value result = pop();
+    TARGET(OP_RETURN) {
+      Value result = POP();
       // update any references to the stack
       // (in closure) to a heap copy
-      closeUpvalues(frame->slots);
+      closeUpvalues(slots);
       vm.frameCount--;
       // end of script
       if (vm.frameCount == 0) {
-        pop();
+        vm.stackTop = stackTop - 1;
         return INTERPRET_OK;
       }
 
-      vm.stackTop =
-          frame->slots; // this points to the the top of the caller stack
+      vm.stackTop = slots; // this points to the the top of the caller stack
       push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      // back to the frame that called `run()`: it was the caller
+      if (vm.frameCount == baseFrame)
+        return INTERPRET_OK;
+      LOAD_FRAME();
+      SAFEPOINT();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_CLASS: {
+    TARGET(OP_CLASS) {
+      ObjString *name = READ_STRING();
+      STORE_FRAME(); // allocates
       // push class value onto stack
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
+      PUSH(OBJ_VAL(newClass(name)));
+      DISPATCH();
     }
-    case OP_INHERIT: {
-      Value superClass = peek(1);
+    TARGET(OP_INHERIT) {
+      Value superClass = PEEK(1);
       if (!IS_CLASS(superClass)) {
-        runtimeError("Superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      ObjClass *subClass = AS_CLASS(peek(0));
+      ObjClass *subClass = AS_CLASS(PEEK(0));
+      // no write barrier: the subclass was just created, with no safepoint
+      // since. It is young, or remembered (see `heapAllocate()`). And an
+      // incremental marking only marks it if it starts in `tableAddAll()`,
+      // from the roots: then the superclass, and its methods, are marked.
+      STORE_FRAME(); // tableAddAll() might trigger the GC
       // duplicate SuperClass methods into Child ones
       tableAddAll(&AS_CLASS(superClass)->methods, &subClass->methods);
-      pop(); // pop SubClass
-      break;
+      subClass->version++; // invalidate the inline caches
+      (void)POP(); // pop SubClass
+      DISPATCH();
     }
-    case OP_METHOD: {
-      defineMethod(READ_STRING());
-      break;
+    TARGET(OP_METHOD) {
+      ObjString *name = READ_STRING();
+      STORE_FRAME();
+      defineMethod(name);
+      stackTop = vm.stackTop;
+      DISPATCH();
+    }
+    }
+  }
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef TRACE_INSTRUCTION
+#undef JIT_ENTER
+#undef SAFEPOINT
+#undef TARGET
+#undef DISPATCH
+}
+
+#ifdef JIT
+// Runtime helpers of the machine code (see jit.h). The machine code
+// stored `vm.stackTop`, and the `ip` of its frame, before calling them.
+
+// Run the frame just pushed by a call, until it returns
+static bool runFrame(void) {
+  int base = vm.frameCount - 1;
+  // `vm.frames` moves when it grows, hence `vm.frames[base]`
+  while (vm.jit && jitShouldEnter(&vm.frames[base])) {
+    if (jitEnter(&vm.frames[base]) != INTERPRET_OK)
+      return false;
+    // returned, or tail called another function in the same frame
+    if (vm.frameCount == base)
+      return true;
+  }
+  return run(base) == INTERPRET_OK;
+}
+
+bool jitRuntimeError(const char *message) {
+  runtimeError("%s", message);
+  return false;
+}
+
+bool jitUndefinedVariable(int slot) {
+  runtimeError("Undefined variable '%s'.",
+               AS_STRING(vm.globalNames.values[slot])->chars);
+  return false;
+}
+
+bool jitAdd(void) {
+  if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+    concatenate();
+    return true;
+  }
+  runtimeError("Operands must be two numbers or two strings.");
+  return false;
+}
+
+// two different objects, they may still be equal strings (see
+// `stringsEqual()`)
+bool jitEqual(void) {
+  Value equal = BOOL_VAL(valuesEqual(peek(1), peek(0)));
+  pop();
+  pop();
+  push(equal);
+  return true;
+}
+
+bool jitPrint(void) {
+  printValue(pop());
+  printf("\n");
+  return true;
+}
+
+bool jitCall(int argCount) {
+  int frameCount = vm.frameCount;
+  if (!callValue(peek(argCount), argCount))
+    return false;
+  return vm.frameCount == frameCount || runFrame();
+}
+
+bool jitInvoke(Value name, int argCount, InlineCache *cache) {
+  int frameCount = vm.frameCount;
+  ObjFunction *function = vm.frames[frameCount - 1].closure->function;
+  if (!invoke(function, cache, AS_STRING(name), argCount))
+    return false;
+  return vm.frameCount == frameCount || runFrame();
+}
+
+bool jitSuperInvoke(Value name, int argCount) {
+  ObjClass *superClass = AS_CLASS(pop());
+  if (!invokeFromClass(superClass, AS_STRING(name), argCount))
+    return false;
+  return runFrame();
+}
+
+bool jitTailCall(int argCount) {
+  dropFrame(argCount);
+  return callValue(peek(argCount), argCount);
+}
+
+bool jitTailInvoke(Value name, int argCount, InlineCache *cache) {
+  ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+  dropFrame(argCount);
+  return invoke(function, cache, AS_STRING(name), argCount);
+}
+
+bool jitTailSuperInvoke(Value name, int argCount) {
+  ObjClass *superClass = AS_CLASS(pop());
+  dropFrame(argCount);
+  return invokeFromClass(superClass, AS_STRING(name), argCount);
+}
+
+bool jitGetProperty(Value name, InlineCache *cache) {
+  if (!IS_INSTANCE(peek(0))) {
+    runtimeError("Only instances haves properties.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(0));
+  ObjClosure *method;
+  Value *field =
+      lookupProperty(vm.frames[vm.frameCount - 1].closure->function, cache,
+                     instance, AS_STRING(name), &method, CACHE_GET_PROPERTY);
+  if (field != NULL) {
+    vm.stackTop[-1] = *field;
+    return true;
+  }
+  if (method == NULL) {
+    runtimeError("Undefined property '%s'.", AS_STRING(name)->chars);
+    return false;
+  }
+  ObjBoundMethod *bound = newBoundMethod(peek(0), method);
+  vm.stackTop[-1] = OBJ_VAL(bound);
+  return true;
+}
+
+bool jitSetProperty(Value name, InlineCache *cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances haves properties.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(peek(1));
+  if (cachedSetField(cache, instance, peek(0))) {
+    COUNT_CACHE(cacheHits, CACHE_SET_PROPERTY);
+  } else {
+    COUNT_CACHE(cacheMisses, CACHE_SET_PROPERTY);
+    ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+    ObjShape *shape = instance->shape;
+    instanceSetField(instance, AS_STRING(name), peek(0));
+    if (instance->shape == shape) {
+      fillCache(function, cache, shape,
+                shapeFieldIndex(shape, AS_STRING(name)), NULL, NULL);
+    } else {
+      fillCache(function, cache, shape, instance->shape->fieldCount - 1, NULL,
+                instance->shape);
+    }
+  }
+  Value value = pop();
+  vm.stackTop[-1] = value; // replace the instance
+  return true;
+}
+
+bool jitGetSuper(Value name) {
+  ObjClass *superClass = AS_CLASS(pop());
+  return bindMethod(superClass, AS_STRING(name));
+}
+
+bool jitClosure(uint8_t *operands) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  ObjFunction *function =
+      AS_FUNCTION(frame->closure->function->chunk.constants.values[*operands++]);
+  ObjClosure *closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *operands++;
+    uint8_t index = *operands++;
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+    writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
+  }
+  return true;
+}
+
+bool jitCloseUpvalue(void) {
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+  return true;
+}
+
+bool jitReturn(CallFrame *frame) {
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  if (vm.frameCount > 0) {
+    push(result);
+  }
+  return true;
+}
+
+bool jitClass(Value name) {
+  push(OBJ_VAL(newClass(AS_STRING(name))));
+  return true;
+}
+
+bool jitInherit(void) {
+  Value superClass = peek(1);
+  if (!IS_CLASS(superClass)) {
+    runtimeError("Superclass must be a class.");
+    return false;
+  }
+  ObjClass *subClass = AS_CLASS(peek(0));
+  tableAddAll(&AS_CLASS(superClass)->methods, &subClass->methods);
+  subClass->version++; // invalidate the inline caches
+  pop(); // pop SubClass
+  return true;
+}
+
+bool jitMethod(Value name) {
+  defineMethod(AS_STRING(name));
+  return true;
+}
+
+bool jitSafepoint(void) {
+  collectNursery();
+  return true;
+}
+
+// `OP_SET_UPVALUE` with its barriers: when storing an object, or while
+// the background thread marks.
+bool jitSetUpvalue(int index) {
+  ObjUpvalue *upvalue = vm.frames[vm.frameCount - 1].closure->upvalues[index];
+  deletionBarrier(*upvalue->location);
+  writeBarrier((Obj *)upvalue, vm.stackTop[-1]);
+  *upvalue->location = vm.stackTop[-1];
+  return true;
+}
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+// print the registers of `frame` and the instruction about to be executed.
+static void traceRegisterExecution(CallFrame *frame) {
+  printf("           ");
+  for (Value *slot = frame->slots; slot < vm.stackTop; slot++) {
+    printf("[");
+    printValue(*slot);
+    printf("]");
+  }
+  printf("\n");
+  Chunk *chunk = &frame->closure->function->chunk;
+  disassembleRegisterInstruction(chunk,
+                                 (int)(frame->ip - chunk->registers.code));
+}
+#endif
+
+/**
+ * Enter the frame pushed by a call from a register frame: the callee
+ * executes its register code, in its own registers. They are not cleared:
+ * the register code never reads a register before writing it, and the GC
+ * clears the stack above `vm.stackTop`, up to `vm.stackHighWater` (see
+ * `clearDeadStack()`). Returns false on stack overflow.
+ */
+static inline bool enterRegisterFrame(CallFrame *frame) {
+  RegisterCode *code = &frame->closure->function->chunk.registers;
+  int stackEnd = (int)(frame->slots - vm.stack) + code->registerCount;
+  if (stackEnd > vm.stackCapacity && !growStack(stackEnd)) {
+    return false;
+  }
+  if (stackEnd > vm.stackHighWater) {
+    vm.stackHighWater = stackEnd;
+  }
+  vm.stackTop = frame->slots + code->registerCount;
+  frame->ip = code->code;
+  return true;
+}
+
+/**
+ * Execute the register code of the topmost frame (see `RegisterOpCode`).
+ *
+ * Each frame owns the `registerCount` slots of the stack starting at its
+ * `slots`, and `vm.stackTop` always points right after them, so the GC
+ * scans every register. A call moves `vm.stackTop` right after its
+ * arguments (R[A+1]..R[A+B]), as the stack VM expects it, which makes
+ * them the first registers of the callee.
+ */
+#if defined(THREADED_DISPATCH) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
+static InterpretResult runRegister() {
+  CallFrame *frame;
+  uint8_t *ip;         // mirror of `frame->ip`
+  Value *R;            // mirror of `frame->slots`: the registers
+  Value *constants;    // constant pool of the current chunk
+  InlineCache *caches; // inline caches of the current chunk
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    R = frame->slots;                                                          \
+    constants = frame->closure->function->chunk.constants.values;              \
+    caches = frame->closure->function->chunk.caches;                           \
+  } while (false)
+// end of the registers of the current frame
+#define FRAME_END() (R + frame->closure->function->chunk.registers.registerCount)
+// see `run()`
+#define SAFEPOINT()                                                            \
+  do {                                                                         \
+    if (vm.nurseryFull) {                                                      \
+      STORE_FRAME();                                                           \
+      collectNursery();                                                        \
+      LOAD_FRAME();                                                            \
+    }                                                                          \
+  } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define READ_REGISTER() (R[READ_BYTE()])
+#define GLOBAL_NAME(slot) (AS_STRING(vm.globalNames.values[slot])->chars)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+// `R[A] = R[B] op R[C]`, or `K[C]` if `readRight` is `READ_CONSTANT`
+#define BINARY_OP(valueType, op, readRight)                                    \
+  do {                                                                         \
+    Value *dest = &READ_REGISTER();                                            \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readRight();                                                     \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers");                               \
+    }                                                                          \
+    *dest = valueType(AS_NUMBER(a) op AS_NUMBER(b));                           \
+  } while (false)
+#define ADD_OP(readRight)                                                      \
+  do {                                                                         \
+    Value *dest = &READ_REGISTER();                                            \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readRight();                                                     \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      *dest = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                         \
+    } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {                         \
+      STORE_FRAME(); /* allocates, both operands stay reachable */             \
+      *dest = OBJ_VAL(concatenateStrings(AS_OBJ(a), AS_OBJ(b)));               \
+    } else {                                                                   \
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");           \
+    }                                                                          \
+  } while (false)
+// run the stack VM `call` of R[callee], with the `argCount` arguments
+// above it. The stack VM expects them on top of the stack.
+#define CALL_REGISTERS(call)                                                   \
+  do {                                                                         \
+    vm.stackTop = callee + argCount + 1;                                       \
+    int frameCount = vm.frameCount;                                            \
+    if (!(call)) {                                                             \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    if (vm.frameCount != frameCount) {                                         \
+      if (!enterRegisterFrame(&vm.frames[vm.frameCount - 1])) {                \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+      LOAD_FRAME();                                                            \
+    } else {                                                                   \
+      /* native function, or class without initializer: the result */         \
+      /* already is in R[A] */                                                 \
+      vm.stackTop = FRAME_END();                                               \
+    }                                                                          \
+  } while (false)
+// tail call: the callee and its arguments slide down to R[0], and the call
+// replaces the frame. Natives return right away, to the caller.
+#define TAIL_CALL_REGISTERS(call)                                              \
+  do {                                                                         \
+    vm.stackTop = callee + argCount + 1;                                       \
+    dropFrame(argCount);                                                       \
+    int frameCount = vm.frameCount;                                            \
+    if (!(call)) {                                                             \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    if (vm.frameCount != frameCount &&                                         \
+        !enterRegisterFrame(&vm.frames[vm.frameCount - 1])) {                  \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    vm.stackTop = FRAME_END();                                                 \
+    SAFEPOINT();                                                               \
+  } while (false)
+// jump if `!(R[A] op R[B])`, or `K[B]` if `readRight` is `READ_CONSTANT`
+#define COMPARE_JUMP(op, readRight)                                            \
+  do {                                                                         \
+    Value a = READ_REGISTER();                                                 \
+    Value b = readRight();                                                     \
+    uint16_t offset = READ_SHORT();                                            \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers");                               \
+    }                                                                          \
+    if (!(AS_NUMBER(a) op AS_NUMBER(b)))                                       \
+      ip += offset;                                                            \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    traceRegisterExecution(frame);                                             \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef THREADED_DISPATCH
+  static void *dispatchTable[] = {
+      [REG_MOVE] = &&TARGET_REG_MOVE,
+      [REG_LOADK] = &&TARGET_REG_LOADK,
+      [REG_LOADNIL] = &&TARGET_REG_LOADNIL,
+      [REG_LOADTRUE] = &&TARGET_REG_LOADTRUE,
+      [REG_LOADFALSE] = &&TARGET_REG_LOADFALSE,
+      [REG_GET_GLOBAL] = &&TARGET_REG_GET_GLOBAL,
+      [REG_DEFINE_GLOBAL] = &&TARGET_REG_DEFINE_GLOBAL,
+      [REG_SET_GLOBAL] = &&TARGET_REG_SET_GLOBAL,
+      [REG_GET_UPVALUE] = &&TARGET_REG_GET_UPVALUE,
+      [REG_SET_UPVALUE] = &&TARGET_REG_SET_UPVALUE,
+      [REG_GET_PROPERTY] = &&TARGET_REG_GET_PROPERTY,
+      [REG_SET_PROPERTY] = &&TARGET_REG_SET_PROPERTY,
+      [REG_GET_SUPER] = &&TARGET_REG_GET_SUPER,
+      [REG_EQUAL] = &&TARGET_REG_EQUAL,
+      [REG_GREATER] = &&TARGET_REG_GREATER,
+      [REG_LESS] = &&TARGET_REG_LESS,
+      [REG_ADD] = &&TARGET_REG_ADD,
+      [REG_SUBSTRACT] = &&TARGET_REG_SUBSTRACT,
+      [REG_MULTIPLY] = &&TARGET_REG_MULTIPLY,
+      [REG_DIVIDE] = &&TARGET_REG_DIVIDE,
+      [REG_EQUAL_K] = &&TARGET_REG_EQUAL_K,
+      [REG_GREATER_K] = &&TARGET_REG_GREATER_K,
+      [REG_LESS_K] = &&TARGET_REG_LESS_K,
+      [REG_ADD_K] = &&TARGET_REG_ADD_K,
+      [REG_SUBSTRACT_K] = &&TARGET_REG_SUBSTRACT_K,
+      [REG_MULTIPLY_K] = &&TARGET_REG_MULTIPLY_K,
+      [REG_DIVIDE_K] = &&TARGET_REG_DIVIDE_K,
+      [REG_NOT] = &&TARGET_REG_NOT,
+      [REG_NEGATE] = &&TARGET_REG_NEGATE,
+      [REG_PRINT] = &&TARGET_REG_PRINT,
+      [REG_JUMP] = &&TARGET_REG_JUMP,
+      [REG_LOOP] = &&TARGET_REG_LOOP,
+      [REG_JUMP_IF_FALSE] = &&TARGET_REG_JUMP_IF_FALSE,
+      [REG_JUMP_IF_TRUE] = &&TARGET_REG_JUMP_IF_TRUE,
+      [REG_JUMP_IF_NOT_LESS] = &&TARGET_REG_JUMP_IF_NOT_LESS,
+      [REG_JUMP_IF_NOT_LESS_K] = &&TARGET_REG_JUMP_IF_NOT_LESS_K,
+      [REG_JUMP_IF_NOT_GREATER] = &&TARGET_REG_JUMP_IF_NOT_GREATER,
+      [REG_JUMP_IF_NOT_GREATER_K] = &&TARGET_REG_JUMP_IF_NOT_GREATER_K,
+      [REG_CALL] = &&TARGET_REG_CALL,
+      [REG_INVOKE] = &&TARGET_REG_INVOKE,
+      [REG_SUPER_INVOKE] = &&TARGET_REG_SUPER_INVOKE,
+      [REG_TAIL_CALL] = &&TARGET_REG_TAIL_CALL,
+      [REG_TAIL_INVOKE] = &&TARGET_REG_TAIL_INVOKE,
+      [REG_TAIL_SUPER_INVOKE] = &&TARGET_REG_TAIL_SUPER_INVOKE,
+      [REG_CLOSURE] = &&TARGET_REG_CLOSURE,
+      [REG_CLOSE] = &&TARGET_REG_CLOSE,
+      [REG_RETURN] = &&TARGET_REG_RETURN,
+      [REG_CLASS] = &&TARGET_REG_CLASS,
+      [REG_INHERIT] = &&TARGET_REG_INHERIT,
+      [REG_METHOD] = &&TARGET_REG_METHOD,
+  };
+#define TARGET(op)                                                             \
+  TARGET_##op:                                                                 \
+  case op:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    goto *dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+#else
+#define TARGET(op) case op:
+#define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
+  for (;;) {
+    TRACE_INSTRUCTION();
+    switch (READ_BYTE()) {
+    TARGET(REG_MOVE) {
+      Value *dest = &READ_REGISTER();
+      *dest = READ_REGISTER();
+      DISPATCH();
+    }
+    TARGET(REG_LOADK) {
+      Value *dest = &READ_REGISTER();
+      *dest = READ_CONSTANT();
+      DISPATCH();
+    }
+    TARGET(REG_LOADNIL)
+      READ_REGISTER() = NIL_VAL;
+      DISPATCH();
+    TARGET(REG_LOADTRUE)
+      READ_REGISTER() = BOOL_VAL(true);
+      DISPATCH();
+    TARGET(REG_LOADFALSE)
+      READ_REGISTER() = BOOL_VAL(false);
+      DISPATCH();
+    TARGET(REG_GET_GLOBAL) {
+      Value *dest = &READ_REGISTER();
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      *dest = value;
+      DISPATCH();
+    }
+    TARGET(REG_DEFINE_GLOBAL) {
+      Value value = READ_REGISTER();
+      vm.globalValues.values[READ_SHORT()] = value;
+      DISPATCH();
+    }
+    TARGET(REG_SET_GLOBAL) {
+      Value value = READ_REGISTER();
+      uint16_t slot = READ_SHORT();
+      Value *global = &vm.globalValues.values[slot];
+      if (IS_UNDEFINED(*global)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      *global = value;
+      DISPATCH();
+    }
+    TARGET(REG_GET_UPVALUE) {
+      Value *dest = &READ_REGISTER();
+      *dest = *frame->closure->upvalues[READ_BYTE()]->location;
+      DISPATCH();
+    }
+    TARGET(REG_SET_UPVALUE) {
+      Value value = READ_REGISTER();
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      deletionBarrier(*upvalue->location);
+      writeBarrier((Obj *)upvalue, value);
+      *upvalue->location = value;
+      DISPATCH();
+    }
+    TARGET(REG_GET_PROPERTY) {
+      Value *dest = &READ_REGISTER();
+      Value object = READ_REGISTER();
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      if (!IS_INSTANCE(object)) {
+        RUNTIME_ERROR("Only instances haves properties.");
+      }
+      ObjClosure *method;
+      Value *field = lookupProperty(frame->closure->function, cache,
+                                    AS_INSTANCE(object), name, &method,
+                                    CACHE_GET_PROPERTY);
+      if (field != NULL) {
+        *dest = *field;
+        DISPATCH();
+      }
+      if (method == NULL) {
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+      }
+      STORE_FRAME(); // allocates, `object` stays in its register
+      *dest = OBJ_VAL(newBoundMethod(object, method));
+      DISPATCH();
+    }
+    TARGET(REG_SET_PROPERTY) {
+      Value object = READ_REGISTER();
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      Value value = READ_REGISTER();
+      if (!IS_INSTANCE(object)) {
+        RUNTIME_ERROR("Only instances haves properties.");
+      }
+      ObjInstance *instance = AS_INSTANCE(object);
+      if (cachedSetField(cache, instance, value)) {
+        COUNT_CACHE(cacheHits, CACHE_SET_PROPERTY);
+      } else {
+        COUNT_CACHE(cacheMisses, CACHE_SET_PROPERTY);
+        ObjShape *shape = instance->shape;
+        STORE_FRAME(); // instanceSetField() might trigger the GC
+        instanceSetField(instance, name, value);
+        if (instance->shape == shape) {
+          fillCache(frame->closure->function, cache, shape,
+                    shapeFieldIndex(shape, name), NULL, NULL);
+        } else {
+          fillCache(frame->closure->function, cache, shape,
+                    instance->shape->fieldCount - 1, NULL, instance->shape);
+        }
+      }
+      DISPATCH();
+    }
+    TARGET(REG_GET_SUPER) {
+      Value *dest = &READ_REGISTER();
+      Value receiver = READ_REGISTER();
+      ObjClass *superClass = AS_CLASS(READ_REGISTER());
+      ObjString *name = READ_STRING();
+      Value method;
+      if (!tableGet(&superClass->methods, name, &method)) {
+        RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+      }
+      STORE_FRAME(); // allocates
+      *dest = OBJ_VAL(newBoundMethod(receiver, AS_CLOSURE(method)));
+      DISPATCH();
+    }
+    TARGET(REG_EQUAL) {
+      Value *dest = &READ_REGISTER();
+      Value a = READ_REGISTER();
+      Value b = READ_REGISTER();
+      STORE_FRAME(); // may flatten ropes
+      *dest = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
+    }
+    TARGET(REG_GREATER)
+      BINARY_OP(BOOL_VAL, >, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_LESS)
+      BINARY_OP(BOOL_VAL, <, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_ADD)
+      ADD_OP(READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_SUBSTRACT)
+      BINARY_OP(NUMBER_VAL, -, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_MULTIPLY)
+      BINARY_OP(NUMBER_VAL, *, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_DIVIDE)
+      BINARY_OP(NUMBER_VAL, /, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_EQUAL_K) {
+      Value *dest = &READ_REGISTER();
+      Value a = READ_REGISTER();
+      Value b = READ_CONSTANT();
+      STORE_FRAME(); // may flatten ropes
+      *dest = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
+    }
+    TARGET(REG_GREATER_K)
+      BINARY_OP(BOOL_VAL, >, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_LESS_K)
+      BINARY_OP(BOOL_VAL, <, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_ADD_K)
+      ADD_OP(READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_SUBSTRACT_K)
+      BINARY_OP(NUMBER_VAL, -, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_MULTIPLY_K)
+      BINARY_OP(NUMBER_VAL, *, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_DIVIDE_K)
+      BINARY_OP(NUMBER_VAL, /, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_NOT) {
+      Value *dest = &READ_REGISTER();
+      *dest = BOOL_VAL(isFalsey(READ_REGISTER()));
+      DISPATCH();
+    }
+    TARGET(REG_NEGATE) {
+      Value *dest = &READ_REGISTER();
+      Value value = READ_REGISTER();
+      if (!IS_NUMBER(value)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      *dest = NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    TARGET(REG_PRINT)
+      printValue(READ_REGISTER());
+      printf("\n");
+      DISPATCH();
+    TARGET(REG_JUMP) {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    TARGET(REG_LOOP) {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      SAFEPOINT();
+      DISPATCH();
+    }
+    TARGET(REG_JUMP_IF_FALSE) {
+      Value condition = READ_REGISTER();
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(condition))
+        ip += offset;
+      DISPATCH();
+    }
+    TARGET(REG_JUMP_IF_TRUE) {
+      Value condition = READ_REGISTER();
+      uint16_t offset = READ_SHORT();
+      if (!isFalsey(condition))
+        ip += offset;
+      DISPATCH();
+    }
+    TARGET(REG_JUMP_IF_NOT_LESS)
+      COMPARE_JUMP(<, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_JUMP_IF_NOT_LESS_K)
+      COMPARE_JUMP(<, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_JUMP_IF_NOT_GREATER)
+      COMPARE_JUMP(>, READ_REGISTER);
+      DISPATCH();
+    TARGET(REG_JUMP_IF_NOT_GREATER_K)
+      COMPARE_JUMP(>, READ_CONSTANT);
+      DISPATCH();
+    TARGET(REG_CALL) {
+      Value *callee = &READ_REGISTER();
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      if (IS_CLOSURE(*callee) && vm.frameCount < vm.frameCapacity &&
+          AS_CLOSURE(*callee)->function->arity == argCount) {
+        // fast path of `call()`: the common case of calling a function
+        frame = &vm.frames[vm.frameCount++];
+        frame->closure = AS_CLOSURE(*callee);
+        frame->slots = callee;
+        if (!enterRegisterFrame(frame)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CALL_REGISTERS(callValue(*callee, argCount));
+      DISPATCH();
+    }
+    TARGET(REG_INVOKE) {
+      Value *callee = &READ_REGISTER();
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      STORE_FRAME();
+      if (IS_INSTANCE(*callee) && vm.frameCount < vm.frameCapacity) {
+        // fast path of `invoke()`: calling a method of the class
+        ObjClosure *method;
+        Value *field =
+            lookupProperty(frame->closure->function, cache,
+                           AS_INSTANCE(*callee), name, &method, CACHE_INVOKE);
+        if (field == NULL && method != NULL &&
+            method->function->arity == argCount) {
+          frame = &vm.frames[vm.frameCount++];
+          frame->closure = method;
+          frame->slots = callee;
+          if (!enterRegisterFrame(frame)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          LOAD_FRAME();
+          DISPATCH();
+        }
+      }
+      CALL_REGISTERS(invoke(frame->closure->function, cache, name, argCount));
+      DISPATCH();
+    }
+    TARGET(REG_SUPER_INVOKE) {
+      Value *callee = &READ_REGISTER();
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superClass = AS_CLASS(READ_REGISTER());
+      STORE_FRAME();
+      CALL_REGISTERS(invokeFromClass(superClass, name, argCount));
+      DISPATCH();
+    }
+    TARGET(REG_TAIL_CALL) {
+      Value *callee = &READ_REGISTER();
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      TAIL_CALL_REGISTERS(callValue(peek(argCount), argCount));
+      DISPATCH();
+    }
+    TARGET(REG_TAIL_INVOKE) {
+      Value *callee = &READ_REGISTER();
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      ObjFunction *function = frame->closure->function; // owns `cache`
+      STORE_FRAME();
+      TAIL_CALL_REGISTERS(invoke(function, cache, name, argCount));
+      DISPATCH();
+    }
+    TARGET(REG_TAIL_SUPER_INVOKE) {
+      Value *callee = &READ_REGISTER();
+      ObjString *name = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superClass = AS_CLASS(READ_REGISTER());
+      STORE_FRAME();
+      TAIL_CALL_REGISTERS(invokeFromClass(superClass, name, argCount));
+      DISPATCH();
+    }
+    TARGET(REG_CLOSURE) {
+      Value *dest = &READ_REGISTER();
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME(); // allocates
+      ObjClosure *closure = newClosure(function);
+      *dest = OBJ_VAL(closure); // reachable while capturing upvalues
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(R + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
+      }
+      DISPATCH();
+    }
+    TARGET(REG_CLOSE)
+      closeUpvalues(&READ_REGISTER());
+      DISPATCH();
+    TARGET(REG_RETURN) {
+      Value result = READ_REGISTER();
+      closeUpvalues(R);
+      vm.frameCount--;
+      if (vm.frameCount == 0) {
+        vm.stackTop = vm.stack;
+        return INTERPRET_OK;
+      }
+      R[0] = result; // R[A] of the caller
+      LOAD_FRAME();
+      vm.stackTop = FRAME_END();
+      SAFEPOINT();
+      DISPATCH();
+    }
+    TARGET(REG_CLASS) {
+      Value *dest = &READ_REGISTER();
+      ObjString *name = READ_STRING();
+      STORE_FRAME(); // allocates
+      *dest = OBJ_VAL(newClass(name));
+      DISPATCH();
+    }
+    TARGET(REG_INHERIT) {
+      Value superClass = READ_REGISTER();
+      ObjClass *subClass = AS_CLASS(READ_REGISTER());
+      if (!IS_CLASS(superClass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
+      }
+      STORE_FRAME(); // tableAddAll() might trigger the GC
+      tableAddAll(&AS_CLASS(superClass)->methods, &subClass->methods);
+      subClass->version++; // invalidate the inline caches
+      DISPATCH();
+    }
+    TARGET(REG_METHOD) {
+      ObjClass *klass = AS_CLASS(READ_REGISTER());
+      Value method = READ_REGISTER();
+      ObjString *name = READ_STRING();
+      STORE_FRAME(); // tableSet() might trigger the GC
+      tableSet(&klass->methods, name, method);
+      writeBarrier((Obj *)klass, OBJ_VAL(name));
+      writeBarrier((Obj *)klass, method);
+      klass->version++; // invalidate the inline caches
+      DISPATCH();
     }
     }
   }
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef FRAME_END
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef READ_REGISTER
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef ADD_OP
+#undef COMPARE_JUMP
+#undef CALL_REGISTERS
+#undef TAIL_CALL_REGISTERS
+#undef SAFEPOINT
+#undef TRACE_INSTRUCTION
+#undef TARGET
+#undef DISPATCH
 }
 
 /** compile and run a script.
@@ -661,5 +2345,10 @@ InterpretResult interpret(const char *source) {
 
   call(closure, 0);
 
-  return run();
+  if (vm.backend == BACKEND_REGISTER) {
+    if (!enterRegisterFrame(&vm.frames[0]))
+      return INTERPRET_RUNTIME_ERROR;
+    return runRegister();
+  }
+  return run(0);
 }
@@ -5,8 +5,18 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX 256
+// Hard limits of the call stack: recursing deeper is a "Stack overflow."
+// runtime error. Build with `-DFRAMES_MAX=...` or `-DSTACK_MAX=...` (in
+// values) to change them.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 65536
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 22)
+#endif
+// initial sizes of the call stack, doubled when a call needs more
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
 
 typedef struct {
   ObjClosure *closure;
@@ -16,22 +26,92 @@ typedef struct {
                 // the call, it point to the end of the caller stack
 } CallFrame;
 
+// phase of the major collection (see memory.c)
+typedef enum {
+  GC_IDLE,  // not collecting
+  GC_MARK,  // marking incrementally, between slices
+  GC_SWEEP, // sweeping `vm.sweepPages`, lazily and between slices
+  GC_CONCURRENT_MARK, // marking in the background thread
+} GCPhase;
+
+// size classes of the old generation: cells of 16, 32, ... 256 bytes, then
+// 4 classes per doubling up to 8 KiB. The last one is for the larger
+// objects, each one alone in its page.
+#define GC_SIZE_CLASSES 37
+#define GC_LARGE_CLASS (GC_SIZE_CLASSES - 1)
+
+typedef struct Page Page; // see memory.c
+
+// pause durations histogram: bucket `i` counts the pauses under 2^i µs
+// (and over the previous bucket), the last one the longer ones.
+#define GC_PAUSE_BUCKETS 18
+
+// collections run so far, and their pauses (in seconds)
+typedef struct {
+  int minorCount;
+  double minorTime;
+  double minorMaxPause;
+  size_t promotedBytes; // copied from the nursery to the old generation
+  int majorCount;       // completed major collections
+  double majorTime;     // all their pauses, slices included
+  double majorMaxPause;
+  int sliceCount; // pauses of the incremental major collections
+  double markerTime; // spent marking by the background thread
+  double traceTime;  // spent marking in the stop-the-world pauses
+  double lazySweepTime; // spent sweeping pages on demand, in allocations
+  int compactCount;
+  double compactTime;
+  size_t compactedBytes; // moved out of the evacuated pages
+  size_t releasedPages;  // evacuated, then freed
+  int pauseHistogram[GC_PAUSE_BUCKETS]; // minor and major pauses
+} GCStats;
+
+// which instruction set runs the compiled code
+typedef enum {
+  BACKEND_STACK,    // stack-based bytecode, see `run()`
+  BACKEND_REGISTER, // register-based bytecode, see `runRegister()`
+} Backend;
+
 typedef struct {
   // Stack frames, grows when calling into a closure/method
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frameCount;
-  // stores evaluated values
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // stores evaluated values (or the registers of each frame).
+  // Reallocated when it grows (see `call()`): only hold indices into it
+  // across calls.
+  Value *stack;
+  int stackCapacity;
+  // end of the slots written past the top since the last collection: the
+  // GC clears them for the register backend (see `clearDeadStack()`)
+  int stackHighWater;
   // stack pointer, points to next empty value
   Value *stackTop;
-  // Global variables values, by name
-  Table globals;
+  // Global variables slot index, by name (resolved by the compiler)
+  Table globalSlots;
+  // Global variables values, by slot index (UNDEFINED_VAL until defined)
+  ValueArray globalValues;
+  // Global variables names, by slot index (for error messages)
+  ValueArray globalNames;
   // ALL interned strings
   Table strings;
   // name of the "init" method in class definition
   ObjString *initString;
-  // Head of the heap object linked list
-  Obj *objects;
+  // the old generation: pages of cells, by size (see memory.c)
+  Page *pages;
+  // pages with free cells, for each size class
+  Page *freePages[GC_SIZE_CLASSES];
+  // young generation: new objects are bump allocated in
+  // [nursery, nurseryEnd), `nurseryTop` is the next free byte.
+  uint8_t *nursery;
+  uint8_t *nurseryTop;
+  uint8_t *nurseryEnd;
+  // the nursery filled up: collect it at the next safepoint
+  bool nurseryFull;
+  // old objects that may reference young ones (see `writeBarrier()`)
+  Obj **remembered;
+  int rememberedCount;
+  int rememberedCapacity;
   // number of objects ref in the `grayStack`
   int grayCount;
   // capacity of the gray stack
@@ -45,6 +125,37 @@ typedef struct {
   // when `bytesAllocated` crosses that treshold,
   // trigger a GC cycle.
   size_t nextGC;
+  // pause budget (in µs) of the incremental major collection slices, 0 for
+  // stop-the-world major collections
+  int gcSliceBudget;
+  // mark the old generation in a background thread (see memory.c)
+  bool gcConcurrent;
+  // threads marking in the stop-the-world pauses
+  int gcThreads;
+  // compact the old generation once a major collection leaves its pages
+  // less than that percent full, 0 to never compact
+  int gcCompact;
+  // the last major collection asked for a compaction (see `compactHeap()`)
+  bool gcCompactPending;
+  GCPhase gcPhase;
+  // value of the mark bits of the old objects the running (or last) major
+  // collection marked: 0 or 1, flips when the next one starts
+  int gcEpoch;
+  // `bytesAllocated` over which the next slice runs
+  size_t gcNextSlice;
+  // pages left to sweep (GC_SWEEP), out of `pages`, for each size class
+  Page *sweepPages[GC_SIZE_CLASSES];
+  GCStats gcStats;
+  // print `gcStats` when the VM is freed
+  bool showGCStats;
+  // print the probe lengths of the tables when the VM is freed
+  bool showTableStats;
+  // instruction set used by `interpret()`
+  Backend backend;
+  // compile hot functions to machine code (stack backend only)
+  bool jit;
+  // machine code calls nested in the C stack (see `JIT_MAX_DEPTH`)
+  int jitDepth;
 } VM;
 
 typedef enum {
@@ -62,5 +173,6 @@ void freeVM();
 InterpretResult interpret(const char *source);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString *name);
 
 #endif